@@ -0,0 +1,70 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <TinyMqtt/MqttAllocations.h>
+
+/***
+ * Helpers shared by the host benchmarks (see README.md). Each result is
+ * printed on stdout as one JSON object per line, so that runs of two
+ * commits can be compared with a script.
+ */
+namespace Bench
+{
+  inline uint64_t nanos()
+  {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Keeps the compiler from removing a computation whose result is unused
+  template<class T>
+  inline void keep(const T& value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+  /** Runs fun ops times after ops/10 warm up calls, then prints
+      {"bench":name,"ops":ops,"ns_per_op":..,"allocs_per_op":..}
+      allocs_per_op is null without -DTINY_MQTT_TRACK_ALLOCATIONS */
+  template<class Fun>
+  void run(const char* name, uint32_t ops, Fun fun)
+  {
+    for(uint32_t i = 0; i < ops / 10; i++) fun(i);
+
+    MqttAllocationScope allocations;
+    uint64_t start = nanos();
+    for(uint32_t i = 0; i < ops; i++) fun(i);
+    uint64_t elapsed = nanos() - start;
+
+    printf("{\"bench\":\"%s\",\"ops\":%u,\"ns_per_op\":%.2f,\"allocs_per_op\":", name, ops,
+      static_cast<double>(elapsed) / ops);
+    if (MqttAllocations::enabled())
+      printf("%.3f}\n", static_cast<double>(allocations.allocations()) / ops);
+    else
+      printf("null}\n");
+    fflush(stdout);
+  }
+
+  /** Percentiles of durations in ns */
+  class Latencies
+  {
+    public:
+      void reserve(size_t n) { samples.reserve(n); }
+      void add(uint64_t ns) { samples.push_back(ns); }
+      size_t size() const { return samples.size(); }
+      void clear() { samples.clear(); }
+
+      // p in [0, 1], sorts the samples
+      uint64_t percentile(double p)
+      {
+        if (samples.empty()) return 0;
+        std::sort(samples.begin(), samples.end());
+        size_t i = static_cast<size_t>(p * (samples.size() - 1));
+        return samples[i];
+      }
+
+    private:
+      std::vector<uint64_t> samples;
+  };
+}
@@ -0,0 +1,177 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Fan-out benchmark of MqttBroker with thousands of clients connected
+ * through in-memory connections (see EpollServer::connectMemory), for host
+ * builds (see ../README.md).
+ *
+ * Settings, from the environment:
+ *   FANOUT_CLIENTS   list of client counts          10,100,1000,10000
+ *   FANOUT_TOPICS    distinct topics published      100
+ *                    (at most MaxTopics)
+ *   FANOUT_SHAPE     subscription of each client:   exact
+ *                    exact (dev/<i % topics>/state), plus (dev/+/state),
+ *                    hash (dev/#)
+ *   FANOUT_RATE      publishes per second, 0 for    1000
+ *                    as fast as possible
+ *   FANOUT_SECONDS   duration of the publishing     2
+ *   FANOUT_PAYLOAD   payload bytes (8 minimum)      32
+ *
+ * Publishes are sent by the clients in turn. Each payload starts with the
+ * time it was written, a delivery latency is measured when a client reads
+ * it. Memory is measured with an MqttCountingResource on every slot, new
+ * for each client count.
+ */
+#include <TinyMqtt/TinyMqtt.h>
+#include "../Bench.h"
+#include "../../tests/Test.h"   // Test::Device
+#include <stdlib.h>
+#include <string.h>
+
+// The StringIndexer holds 255 names, filters included: past that, topics
+// share index 0 and lose their name, and the results mean nothing
+static const uint32_t MaxTopics = 250;
+
+struct Settings
+{
+  uint32_t topics;
+  const char* shape;
+  uint32_t rate;
+  uint32_t seconds;
+  uint32_t payload;
+};
+
+static uint32_t setting(const char* name, uint32_t value)
+{
+  const char* env = getenv(name);
+  return env ? strtoul(env, nullptr, 10) : value;
+}
+
+static size_t memoryInUse(const MqttCountingResource* memory, bool peak)
+{
+  size_t bytes = 0;
+  for(int use = 0; use < MqttMemory::UseCount; use++)
+    bytes += peak ? memory[use].peak() : memory[use].inUse();
+  return bytes;
+}
+
+static void run(uint32_t clients, const Settings& settings)
+{
+  // Fresh for each run, so that the memory and peak reported are its own
+  MqttCountingResource memory[MqttMemory::UseCount];
+  for(int use = 0; use < MqttMemory::UseCount; use++)
+    MqttMemory::set(static_cast<MqttMemory::Use>(use), &memory[use]);
+
+  MqttBroker* broker = new MqttBroker(1883);
+  std::vector<Test::Device> devices(clients);
+  char text[64];
+
+  // Connections, CONNECT and SUBSCRIBE
+  for(uint32_t i = 0; i < clients; i++)
+  {
+    Test::Device& device = devices[i];
+    snprintf(text, sizeof(text), "bench%u", i);
+    device.connect(*broker, text);
+
+    if (strcmp(settings.shape, "plus") == 0)
+      snprintf(text, sizeof(text), "dev/+/state");
+    else if (strcmp(settings.shape, "hash") == 0)
+      snprintf(text, sizeof(text), "dev/#");
+    else
+      snprintf(text, sizeof(text), "dev/%u/state", i % settings.topics);
+    device.subscribe(text);
+    broker->loop();   // accepts one client
+  }
+  for(int i = 0; i < 10; i++) broker->loop();
+  for(auto& device: devices) device.receive();
+
+  std::vector<std::string> topics;
+  for(uint32_t t = 0; t < settings.topics; t++)
+  {
+    snprintf(text, sizeof(text), "dev/%u/state", t);
+    topics.push_back(Test::Device::str(text));
+  }
+  std::string payload(settings.payload < 8 ? 8 : settings.payload, 'x');
+
+  Bench::Latencies latencies;
+  latencies.reserve(1 << 20);
+  uint64_t delivered = 0;
+  uint64_t published = 0;
+  auto on_publish = [&](const char*, size_t, const char* data, size_t len)
+  {
+    uint64_t sent;
+    if (len < sizeof(sent)) return;
+    memcpy(&sent, data, sizeof(sent));
+    latencies.add(Bench::nanos() - sent);
+    delivered++;
+  };
+
+  uint64_t duration = static_cast<uint64_t>(settings.seconds) * 1000000000ull;
+  uint64_t start = Bench::nanos();
+  uint64_t now = start;
+  uint32_t loops = 0;
+  while(now - start < duration)
+  {
+    uint64_t due = settings.rate ? (now - start) * settings.rate / 1000000000ull : published + 1;
+    for(; published < due; published++)
+    {
+      uint64_t stamp = Bench::nanos();
+      memcpy(&payload[0], &stamp, sizeof(stamp));
+      devices[published % clients].send(MqttMessage::Publish, topics[published % settings.topics] + payload);
+    }
+    broker->loop();
+    loops++;
+    for(auto& device: devices) device.receiveRaw(on_publish);
+    now = Bench::nanos();
+  }
+  // Deliveries still in progress
+  for(int i = 0; i < 100; i++)
+  {
+    broker->loop();
+    for(auto& device: devices) device.receiveRaw(on_publish);
+  }
+  double seconds = static_cast<double>(Bench::nanos() - start) / 1e9;
+
+  printf("{\"bench\":\"fanout\",\"clients\":%u,\"topics\":%u,\"shape\":\"%s\",\"rate\":%u,\"payload\":%u,"
+    "\"published\":%llu,\"delivered\":%llu,\"deliveries_per_sec\":%.0f,\"loops\":%u,"
+    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"memory_bytes\":%zu,\"memory_peak_bytes\":%zu}\n",
+    clients, settings.topics, settings.shape, settings.rate, static_cast<unsigned>(payload.size()),
+    static_cast<unsigned long long>(published), static_cast<unsigned long long>(delivered),
+    delivered / seconds, loops,
+    latencies.percentile(0.5) / 1e3, latencies.percentile(0.99) / 1e3, latencies.percentile(0.999) / 1e3,
+    memoryInUse(memory, false), memoryInUse(memory, true));
+  fflush(stdout);
+
+  devices.clear();
+  delete broker;
+  StringIndexer::purge();  // topics of this run, allocated from memory
+  for(int use = 0; use < MqttMemory::UseCount; use++)
+    MqttMemory::set(static_cast<MqttMemory::Use>(use), nullptr);
+}
+
+void setup()
+{
+  Settings settings;
+  settings.topics = setting("FANOUT_TOPICS", 100);
+  settings.shape = getenv("FANOUT_SHAPE") ? getenv("FANOUT_SHAPE") : "exact";
+  settings.rate = setting("FANOUT_RATE", 1000);
+  settings.seconds = setting("FANOUT_SECONDS", 2);
+  settings.payload = setting("FANOUT_PAYLOAD", 32);
+  if (settings.topics == 0) settings.topics = 1;
+  if (settings.topics > MaxTopics)
+  {
+    fprintf(stderr, "FANOUT_TOPICS=%u is over the StringIndexer capacity, using %u\n",
+      settings.topics, MaxTopics);
+    settings.topics = MaxTopics;
+  }
+
+  std::string counts = getenv("FANOUT_CLIENTS") ? getenv("FANOUT_CLIENTS") : "10,100,1000,10000";
+  for(char* count = strtok(&counts[0], ","); count; count = strtok(nullptr, ","))
+    if (atoi(count) > 0) run(atoi(count), settings);
+#ifdef EPOXY_DUINO
+  exit(0);
+#endif
+}
+
+void loop()
+{
+}
@@ -0,0 +1,261 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Benchmark of the gateway with synthetic property sets, for host builds
+ * (see ../README.md). The properties are added in steps, each step is
+ * measured before the next one is added:
+ *
+ *   GW_PROPERTIES   list of property counts     10,100,1000,5000
+ *   GW_ROUNDS       dispatch rounds per count   3
+ *
+ * The properties mimic a mixed installation, in turn:
+ *   bool   Shelly relay     shellies/shelly1-<i>/relay/0          on/off
+ *   bool   Tasmota power    stat/tasmota_<i>/POWER                ON/OFF
+ *   float  Tasmota sensor   tele/tasmota_<i>/SENSOR               {"Temperature":..}
+ *   int    zigbee2mqtt      zigbee2mqtt/sensor_<i>                {"linkquality":..}
+ *   String plain            homie/device_<i>/name                 text
+ *
+ * Measures:
+ *   gateway/dispatch          Gateway::onMsg of a state message that updates
+ *                             its property
+ *   gateway/dispatch/ignored  the same message again, ignored since the
+ *                             property was just updated (IGNORE_STATES_FOR)
+ *   gateway/scan              Gateway::syncProperties() when nothing changed
+ *   gateway/publish           Gateway::loop() after some variables changed,
+ *                             per command published
+ */
+#include <Arduino_MQTT_Gateway.h>
+#include "../Bench.h"
+#include <deque>
+#include <stdlib.h>
+#include <string.h>
+
+// Longer than IGNORE_STATES_FOR: a property updated from MQTT ignores the
+// states received during that time
+static const unsigned long Quiet = 510;
+
+struct Device
+{
+  int kind;           // 0 to Kinds - 1, see the list above
+  bool on;
+  int linkquality;
+  float temperature;
+  String name;
+  // The longest, "shellies/shelly1-%zu/relay/0/command", with 20 digits
+  char state_topic[56];
+  char command_topic[56];
+};
+static const int Kinds = 5;
+
+// Stable addresses: the gateway keeps pointers to the variables and topics
+static std::deque<Device> devices;
+
+static uint32_t setting(const char* name, uint32_t value)
+{
+  const char* env = getenv(name);
+  return env ? strtoul(env, nullptr, 10) : value;
+}
+
+static void addProperties(size_t count)
+{
+  while(devices.size() < count)
+  {
+    size_t i = devices.size();
+    devices.emplace_back();
+    Device& d = devices.back();
+    d.kind = i % Kinds;
+    d.on = false;
+    d.linkquality = 0;
+    d.temperature = 0;
+    d.command_topic[0] = 0;
+    switch(d.kind)
+    {
+      case 0:
+        snprintf(d.state_topic, sizeof(d.state_topic), "shellies/shelly1-%zu/relay/0", i);
+        snprintf(d.command_topic, sizeof(d.command_topic), "shellies/shelly1-%zu/relay/0/command", i);
+        ArduinoMQTTGateway.add(d.on)
+          .setStateTopic(d.state_topic)
+          .setCommandTopic(d.command_topic);
+        break;
+      case 1:
+        snprintf(d.state_topic, sizeof(d.state_topic), "stat/tasmota_%zu/POWER", i);
+        snprintf(d.command_topic, sizeof(d.command_topic), "cmnd/tasmota_%zu/POWER", i);
+        ArduinoMQTTGateway.add(d.on)
+          .setStatePayload("ON", "OFF")
+          .setCommandPayload("ON", "OFF")
+          .setStateTopic(d.state_topic)
+          .setCommandTopic(d.command_topic);
+        break;
+      case 2:
+        snprintf(d.state_topic, sizeof(d.state_topic), "tele/tasmota_%zu/SENSOR", i);
+        ArduinoMQTTGateway.add(d.temperature)
+          .setStateTopic(d.state_topic)
+          .setStatePayloadJSONField("Temperature");
+        break;
+      case 3:
+        snprintf(d.state_topic, sizeof(d.state_topic), "zigbee2mqtt/sensor_%zu", i);
+        snprintf(d.command_topic, sizeof(d.command_topic), "zigbee2mqtt/sensor_%zu/set", i);
+        ArduinoMQTTGateway.add(d.linkquality)
+          .setStateTopic(d.state_topic)
+          .setCommandTopic(d.command_topic)
+          .setStatePayloadJSONField("linkquality");
+        break;
+      default:
+        snprintf(d.state_topic, sizeof(d.state_topic), "homie/device_%zu/name", i);
+        snprintf(d.command_topic, sizeof(d.command_topic), "homie/device_%zu/name/set", i);
+        ArduinoMQTTGateway.add(d.name)
+          .setStateTopic(d.state_topic)
+          .setCommandTopic(d.command_topic);
+        break;
+    }
+  }
+  // The new properties have nothing to publish yet
+  ArduinoMQTTGateway.syncProperties();
+}
+
+// State message of device d for a round, as the device would send it
+static size_t statePayload(const Device& d, uint32_t round, char* buf, size_t size)
+{
+  bool on = round & 1;
+  switch(d.kind)
+  {
+    case 0:
+      return snprintf(buf, size, "%s", on ? "on" : "off");
+    case 1:
+      return snprintf(buf, size, "%s", on ? "ON" : "OFF");
+    case 2:
+      return snprintf(buf, size,
+        "{\"Time\":\"2022-06-01T12:00:00\",\"Temperature\":%.1f,\"Humidity\":40.0,\"TempUnit\":\"C\"}",
+        20.0 + round * 0.1);
+    case 3:
+      return snprintf(buf, size,
+        "{\"battery\":97,\"humidity\":45.2,\"linkquality\":%u,\"temperature\":21.3,\"voltage\":2995}",
+        100 + round);
+    default:
+      return snprintf(buf, size, "device %u", round);
+  }
+}
+
+static void printLatencies(const char* name, size_t properties, Bench::Latencies& latencies,
+  uint64_t elapsed, size_t allocations)
+{
+  size_t n = latencies.size();
+  printf("{\"bench\":\"%s\",\"properties\":%zu,\"messages\":%zu,\"ns_per_msg\":%.1f,"
+    "\"p50_ns\":%llu,\"p99_ns\":%llu,\"allocs_per_msg\":",
+    name, properties, n, n ? static_cast<double>(elapsed) / n : 0.0,
+    static_cast<unsigned long long>(latencies.percentile(0.5)),
+    static_cast<unsigned long long>(latencies.percentile(0.99)));
+  if (MqttAllocations::enabled())
+    printf("%.3f}\n", n ? static_cast<double>(allocations) / n : 0.0);
+  else
+    printf("null}\n");
+  fflush(stdout);
+}
+
+static void benchDispatch(size_t properties, uint32_t rounds)
+{
+  // At most 1000 messages per round, spread over all the properties
+  size_t step = properties > 1000 ? properties / 1000 : 1;
+  Bench::Latencies updated, ignored;
+  uint64_t updated_ns = 0, ignored_ns = 0;
+  size_t updated_allocs = 0, ignored_allocs = 0;
+  char payload[160];
+
+  for(uint32_t round = 1; round <= rounds; round++)
+  {
+    delay(Quiet);
+    for(size_t i = 0; i < properties; i += step)
+    {
+      const Device& d = devices[i];
+      size_t len = statePayload(d, round, payload, sizeof(payload));
+      const Topic topic(d.state_topic);  // interned by the broker before dispatch
+
+      for(int repeat = 0; repeat < 2; repeat++)
+      {
+        MqttAllocationScope allocations;
+        uint64_t start = Bench::nanos();
+        AMG::Gateway::onMsg(nullptr, topic, payload, len);
+        uint64_t elapsed = Bench::nanos() - start;
+        (repeat ? ignored : updated).add(elapsed);
+        (repeat ? ignored_ns : updated_ns) += elapsed;
+        (repeat ? ignored_allocs : updated_allocs) += allocations.allocations();
+      }
+    }
+    // Like the broker, keep no more than the topics in use
+    StringIndexer::purge();
+  }
+  printLatencies("gateway/dispatch", properties, updated, updated_ns, updated_allocs);
+  printLatencies("gateway/dispatch/ignored", properties, ignored, ignored_ns, ignored_allocs);
+}
+
+static void benchScan(size_t properties)
+{
+  char name[40];   // "gateway/scan/" and 20 digits
+  snprintf(name, sizeof(name), "gateway/scan/%zu", properties);
+  uint32_t ops = properties >= 1000 ? 10000 : 100000;
+  Bench::run(name, ops, [](uint32_t) { ArduinoMQTTGateway.syncProperties(); });
+}
+
+static void benchPublish(size_t properties)
+{
+  // Changes, as done by the cloud, of up to 100 variables of all kinds
+  size_t changes = properties < 100 ? properties : 100;
+  size_t step = properties / changes;
+  size_t published = 0;
+  uint64_t elapsed = 0;
+  size_t allocations = 0;
+  for(uint32_t round = 0; round < 20; round++)
+  {
+    for(size_t c = 0; c < changes; c++)
+    {
+      Device& d = devices[c * step];
+      switch(d.kind)
+      {
+        case 0:
+        case 1: d.on = !d.on; break;
+        case 2: d.temperature += 0.5; break;
+        case 3: d.linkquality++; break;
+        default: d.name = (round & 1) ? "kitchen" : "living room"; break;
+      }
+      if (d.command_topic[0]) published++;
+    }
+    MqttAllocationScope scope;
+    uint64_t start = Bench::nanos();
+    ArduinoMQTTGateway.loop();
+    elapsed += Bench::nanos() - start;
+    allocations += scope.allocations();
+  }
+  StringIndexer::purge();
+
+  printf("{\"bench\":\"gateway/publish\",\"properties\":%zu,\"changes_per_loop\":%zu,"
+    "\"publishes\":%zu,\"ns_per_publish\":%.1f,\"allocs_per_publish\":",
+    properties, changes, published, published ? static_cast<double>(elapsed) / published : 0.0);
+  if (MqttAllocations::enabled())
+    printf("%.3f}\n", published ? static_cast<double>(allocations) / published : 0.0);
+  else
+    printf("null}\n");
+  fflush(stdout);
+}
+
+void setup()
+{
+  ArduinoMQTTGateway.attach(new MqttBroker(1883));
+
+  uint32_t rounds = setting("GW_ROUNDS", 3);
+  std::string counts = getenv("GW_PROPERTIES") ? getenv("GW_PROPERTIES") : "10,100,1000,5000";
+  for(char* count = strtok(&counts[0], ","); count; count = strtok(nullptr, ","))
+  {
+    size_t properties = atoi(count);
+    if (properties == 0 or properties < devices.size()) continue;
+    addProperties(properties);
+    benchDispatch(properties, rounds);
+    benchScan(properties);
+    benchPublish(properties);
+  }
+#ifdef EPOXY_DUINO
+  exit(0);
+#endif
+}
+
+void loop()
+{
+}
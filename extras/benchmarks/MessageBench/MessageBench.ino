@@ -0,0 +1,158 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Micro benchmarks of the parsing and encoding of MqttMessage, of
+ * Topic::matches and of StringIndexer, for host builds (see ../README.md).
+ */
+#include <TinyMqtt/TinyMqtt.h>
+#include "../Bench.h"
+
+static const uint32_t Ops = 1000000;
+
+// Bytes of a publish packet as received from the network
+static std::string publishPacket(const char* topic, size_t payload_length)
+{
+  MqttMessage msg(MqttMessage::Publish);
+  msg.add(topic, strlen(topic));
+  std::string payload(payload_length, 'x');
+  msg.add(payload.c_str(), payload.size(), false);
+  msg.complete();
+  return std::string(msg.begin(), msg.end());
+}
+
+static void benchMessages()
+{
+  const std::string small = publishPacket("tele/sonoff/SENSOR", 64);
+  const std::string large = publishPacket("tele/sonoff/SENSOR", 1000);
+  MqttMessage msg;
+
+  Bench::run("incoming/64", Ops, [&](uint32_t)
+  {
+    msg.incoming(small.data(), small.size());
+    Bench::keep(msg.type());
+    msg.reset();
+  });
+
+  Bench::run("incoming/1000", Ops, [&](uint32_t)
+  {
+    msg.incoming(large.data(), large.size());
+    Bench::keep(msg.type());
+    msg.reset();
+  });
+
+  Bench::run("incoming/bytewise/64", Ops / 10, [&](uint32_t)
+  {
+    for(char c: small) msg.incoming(c);
+    Bench::keep(msg.type());
+    msg.reset();
+  });
+
+  // add() and complete() (that is encodeLength) of a publish, as by MqttClient::publish
+  const Topic topic("stat/shelly1/POWER");
+  MqttMessage out;
+  Bench::run("add+encode/publish", Ops, [&](uint32_t)
+  {
+    out.create(MqttMessage::Publish);
+    out.add(topic);
+    out.add("ON", 2, false);
+    out.complete();
+    Bench::keep(out.begin());
+  });
+
+  Bench::run("encode/long", Ops, [&](uint32_t)
+  {
+    out.create(MqttMessage::Publish);
+    out.add(topic);
+    out.add(large.data(), 200, false);
+    out.complete();
+    Bench::keep(out.begin());
+  });
+
+  // The vheader of small starts with the topic
+  msg.incoming(small.data(), small.size());
+  Bench::run("getString", Ops, [&](uint32_t)
+  {
+    const char* p = msg.getVHeader();
+    uint16_t len;
+    MqttMessage::getString(p, len);
+    Bench::keep(p);
+    Bench::keep(len);
+  });
+  msg.reset();
+}
+
+static void benchMatches()
+{
+  struct Case
+  {
+    const char* name;
+    const char* filter;
+    const char* topic;
+  };
+  static const Case cases[] =
+  {
+    // Equal names share their StringIndexer index: resolved without comparing
+    { "matches/exact",     "stat/shelly1/POWER",           "stat/shelly1/POWER" },
+    // Distinct names of the same length, differing early and at the end
+    { "matches/exact/miss", "stat/shelly1/POWER",          "stat/shelly2/POWER" },
+    { "matches/exact/late", "stat/shelly1/POWER",          "stat/shelly1/POWEX" },
+    { "matches/plus",      "stat/+/POWER",                 "stat/shelly1/POWER" },
+    { "matches/hash",      "tele/#",                       "tele/sonoff/SENSOR" },
+    { "matches/deep",      "a/+/c/+/e/+/g/+/i/#",          "a/b/c/d/e/f/g/h/i/j/k/l" },
+    { "matches/deep/miss", "a/+/c/+/e/+/g/+/x/#",          "a/b/c/d/e/f/g/h/i/j/k/l" },
+    { "matches/dollar",    "#",                            "$SYS/broker/uptime" },
+    { "matches/dollar/sys", "$SYS/broker/+",               "$SYS/broker/uptime" },
+  };
+  for(const Case& c: cases)
+  {
+    // Each from its own copy of the text, as when parsed from two packets
+    const std::string filter_text(c.filter);
+    const std::string topic_text(c.topic);
+    const Topic filter(filter_text.c_str());
+    const Topic topic(topic_text.c_str());
+    Bench::run(c.name, Ops, [&](uint32_t) { Bench::keep(filter.matches(topic)); });
+  }
+}
+
+static void benchIndexer()
+{
+  // Topics seen again and again (a device republishing its state)
+  char names[200][32];
+  for(int i = 0; i < 200; i++) snprintf(names[i], sizeof(names[i]), "tele/device%d/STATE", i);
+
+  Bench::run("intern/hit", Ops, [&](uint32_t i)
+  {
+    Topic topic(names[i % 200]);
+    Bench::keep(topic.getIndex());
+  });
+
+  // A topic used once, then forgotten
+  Bench::run("intern/cold", Ops / 10, [&](uint32_t i)
+  {
+    {
+      Topic topic(names[i % 200]);
+      Bench::keep(topic.getIndex());
+    }
+    StringIndexer::purge();
+  });
+
+  const Topic held(names[0]);
+  Bench::run("intern/copy+release", Ops, [&](uint32_t)
+  {
+    Topic copy(held);
+    Bench::keep(copy.getIndex());
+  });
+}
+
+void setup()
+{
+  benchMessages();
+  benchMatches();
+  benchIndexer();
+#ifdef EPOXY_DUINO
+  exit(0);
+#endif
+}
+
+void loop()
+{
+}
@@ -0,0 +1,128 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Steady state without allocation (see MqttAllocations.h): once warmed up,
+ * a publish, its fan-out to several devices and a gateway update cycle
+ * (state received, variables changed, commands published) must not
+ * allocate. Needs -DTINY_MQTT_TRACK_ALLOCATIONS, fails without it.
+ */
+#include <Arduino_MQTT_Gateway.h>
+#include "../Test.h"
+
+// Longer than the time the gateway ignores the states of a property it
+// just updated
+static const unsigned long Quiet = 510;
+
+static const int Subscribers = 8;
+static const int WarmUp = 3;
+static const int Cycles = 3;
+
+static bool relay = false;
+static int level = 0;
+static float setpoint = 0;
+static String label;
+
+struct Allocations
+{
+  uint32_t publish = 0;   // of a publish and its fan-out
+  uint32_t state = 0;     // of the states received by the gateway
+  uint32_t command = 0;   // of the commands published by the gateway
+};
+
+static void configure(MqttBroker& broker)
+{
+  ArduinoMQTTGateway.add(relay).setStateTopic("stat/relay/POWER").setCommandTopic("cmnd/relay/POWER")
+    .setStatePayload("ON", "OFF").setCommandPayload("ON", "OFF");
+  ArduinoMQTTGateway.add(level).setStateTopic("stat/dimmer/level").setCommandTopic("cmnd/dimmer/level");
+  ArduinoMQTTGateway.add(setpoint).setStateTopic("stat/thermostat/setpoint").setCommandTopic("cmnd/thermostat/setpoint");
+  ArduinoMQTTGateway.add(label).setStateTopic("stat/display/label").setCommandTopic("cmnd/display/label");
+  ArduinoMQTTGateway.attach(&broker);
+}
+
+static void settle(Test::Fixture& fixture, Test::Device& actuator)
+{
+  for(int i = 0; i < 10; i++) ArduinoMQTTGateway.loop();
+  fixture.publisher.receive();
+  actuator.receive();
+  fixture.receive();
+}
+
+// Allocations of the broker and gateway for each step of a cycle; the
+// devices, which stand for the network, are outside of the scopes. The
+// publisher is the sensor, the subscribers are dashboards, the actuator
+// receives the commands of the gateway.
+static void cycle(Test::Fixture& fixture, Test::Device& actuator, uint32_t round, Allocations& allocations)
+{
+  Test::Device& sensor = fixture.publisher;
+  char payload[32];
+  snprintf(payload, sizeof(payload), "{\"Temperature\":%u.5}", 20 + round % 10);
+  sensor.publish("tele/room/SENSOR", payload);
+  {
+    MqttAllocationScope scope;
+    ArduinoMQTTGateway.loop();  // receives and fans out the publish
+    allocations.publish += scope.allocations();
+  }
+  TEST_CHECK(fixture.receive() == Subscribers);
+
+  // States from the devices, applied to the variables
+  delay(Quiet);
+  sensor.publish("stat/relay/POWER", round & 1 ? "ON" : "OFF");
+  snprintf(payload, sizeof(payload), "%u", round);
+  sensor.publish("stat/dimmer/level", payload);
+  sensor.publish("stat/display/label", round & 1 ? "kitchen" : "living room");
+  {
+    MqttAllocationScope scope;
+    ArduinoMQTTGateway.loop();
+    ArduinoMQTTGateway.loop();  // the gateway client reads what the broker sent
+    allocations.state += scope.allocations();
+  }
+  TEST_CHECK(relay == (round & 1));
+  TEST_CHECK(level == static_cast<int>(round));
+
+  // Variables changed by the cloud, published as commands
+  relay = not relay;
+  level += 100;
+  setpoint = round & 1 ? -3.4e38f : 21.5f;  // the longest and a short payload
+  label = round & 1 ? "bedroom" : "office";
+  {
+    MqttAllocationScope scope;
+    ArduinoMQTTGateway.loop();
+    ArduinoMQTTGateway.loop();
+    allocations.command += scope.allocations();
+  }
+  size_t received = 0;
+  actuator.receive([&](const std::string&, const std::string&) { received++; });
+  TEST_CHECK(received == 4);
+  sensor.receive();
+}
+
+void setup()
+{
+  if (not TEST_CHECK(MqttAllocations::enabled()))
+  {
+    printf("Build with -DTINY_MQTT_TRACK_ALLOCATIONS\n");
+    Test::finish("AllocationTest");
+  }
+  Test::Fixture fixture("tele/#", configure, Subscribers);
+  Test::Device actuator;
+  actuator.connect(fixture.broker, "actuator");
+  actuator.subscribe("cmnd/#");
+  settle(fixture, actuator);
+
+  uint32_t round = 0;
+  Allocations warm_up;
+  for(int i = 0; i < WarmUp; i++) cycle(fixture, actuator, ++round, warm_up);
+  printf("warm up: %u, %u, %u allocations\n", warm_up.publish, warm_up.state, warm_up.command);
+
+  Allocations steady;
+  for(int i = 0; i < Cycles; i++) cycle(fixture, actuator, ++round, steady);
+  printf("steady state: publish and fan-out %u, gateway states %u, gateway commands %u allocations\n",
+    steady.publish, steady.state, steady.command);
+  TEST_CHECK(steady.publish == 0);
+  TEST_CHECK(steady.state == 0);
+  TEST_CHECK(steady.command == 0);
+  Test::finish("AllocationTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,132 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * MqttClassBinder: publishes routed by client to onPublish() and by topic
+ * filter to member handlers, receivers unregistered when destroyed, routes
+ * added or removed by a handler during a dispatch, and no StringIndexer
+ * slot taken by routes without filter.
+ */
+#include "../Test.h"
+#include <TinyMqtt/MqttClassBinder.h>
+#include <memory>
+
+struct Receiver : public MqttClassBinder<Receiver>
+{
+  size_t all = 0;
+  size_t temperatures = 0;
+  std::string last;
+
+  void onPublish(const MqttClient*, const Topic& topic, const char*, size_t)
+  {
+    all++;
+    last = topic.c_str();
+  }
+
+  void onTemperature(const MqttClient*, const Topic&, const char*, size_t)
+  {
+    temperatures++;
+  }
+};
+
+// Destroys the receiver it points to when called, from inside a dispatch
+struct SelfDestroying;
+static std::unique_ptr<SelfDestroying> added;
+
+struct SelfDestroying : public MqttClassBinder<SelfDestroying>
+{
+  std::unique_ptr<SelfDestroying>* owner = nullptr;
+  MqttClient* client = nullptr;
+
+  void onPublish(const MqttClient*, const Topic&, const char*, size_t)
+  {
+    if (client)
+    {
+      // Adds a route while dispatching, then removes itself
+      added.reset(new SelfDestroying);
+      MqttClassBinder<SelfDestroying>::onPublish(client, added.get());
+      client = nullptr;
+      owner->reset();
+    }
+  }
+};
+
+static size_t unrouted = 0;
+static void onUnrouted(const MqttClient*, const Topic&, const char*, size_t) { unrouted++; }
+
+void setup()
+{
+  MqttBroker broker(1883);
+  MqttClient publisher(&broker, "publisher");
+  MqttClient kitchen(&broker, "kitchen");
+  MqttClient garage(&broker, "garage");
+  kitchen.subscribe("kitchen/#");
+  garage.subscribe("garage/#");
+  MqttClassBinder<Receiver>::onUnpublished(onUnrouted);
+
+  {
+    uint16_t strings = StringIndexer::count();
+    Receiver receiver;
+    MqttClassBinder<Receiver>::onPublish(&kitchen, &receiver);
+    TEST_CHECK(StringIndexer::count() == strings);  // no Topic for an unfiltered route
+
+    MqttClassBinder<Receiver>::onTopic<&Receiver::onTemperature>(&garage, "garage/+/temperature", &receiver);
+    TEST_CHECK(MqttClassBinder<Receiver>::size() == 2);
+
+    publisher.publish("kitchen/light", "on");
+    TEST_CHECK(receiver.all == 1 and receiver.last == "kitchen/light");
+    publisher.publish("garage/door/temperature", "12");
+    TEST_CHECK(receiver.temperatures == 1);
+    publisher.publish("garage/door/state", "open");  // no matching filter
+    TEST_CHECK(receiver.all == 1 and receiver.temperatures == 1);
+    TEST_CHECK(unrouted == 1);
+  }
+  // Destroyed: its routes are gone
+  TEST_CHECK(MqttClassBinder<Receiver>::size() == 0);
+  publisher.publish("kitchen/light", "off");
+  TEST_CHECK(unrouted == 2);
+
+  // Many receivers on many clients, each gets the publishes of its client only
+  {
+    const int Count = 200;
+    std::vector<std::unique_ptr<MqttClient>> clients;
+    std::vector<std::unique_ptr<Receiver>> receivers;
+    char name[32];
+    for(int i = 0; i < Count; i++)
+    {
+      snprintf(name, sizeof(name), "dev%d", i);
+      clients.emplace_back(new MqttClient(&broker, name));
+      receivers.emplace_back(new Receiver);
+      snprintf(name, sizeof(name), "dev/%d/#", i % 50);
+      clients[i]->subscribe(name);
+      MqttClassBinder<Receiver>::onPublish(clients[i].get(), receivers[i].get());
+    }
+    publisher.publish("dev/7/state", "x");
+    size_t wrong = 0;
+    for(int i = 0; i < Count; i++) wrong += receivers[i]->all != (i % 50 == 7 ? 1u : 0u);
+    TEST_CHECK(wrong == 0);
+    receivers.resize(Count / 2);  // the other half unregisters
+    TEST_CHECK(MqttClassBinder<Receiver>::size() == Count / 2);
+    publisher.publish("dev/7/state", "x");
+    TEST_CHECK(receivers[7]->all == 2);
+    MqttClassBinder<Receiver>::reset();
+  }
+
+  // A handler that adds a route and destroys its receiver during the dispatch
+  {
+    std::unique_ptr<SelfDestroying> first(new SelfDestroying);
+    first->owner = &first;
+    first->client = &kitchen;
+    MqttClassBinder<SelfDestroying>::onPublish(&kitchen, first.get());
+    publisher.publish("kitchen/light", "on");
+    TEST_CHECK(first == nullptr);
+    TEST_CHECK(MqttClassBinder<SelfDestroying>::size() == 1);
+    publisher.publish("kitchen/light", "off");  // reaches the added receiver only
+    added.reset();
+    TEST_CHECK(MqttClassBinder<SelfDestroying>::size() == 0);
+  }
+
+  Test::finish("ClassBinderTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,104 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Stress test of MqttFanoutExecutor: thousands of back to back run() calls,
+ * as when a broker loop fans out many publishes in a row, with workers
+ * woken late for a job that is already done. Every subscriber must get
+ * every publish exactly once, in order and with its own payload, and
+ * each delivery is in the flight recorder.
+ */
+#include "../Test.h"
+#include <vector>
+
+static const int Publishes = 5000;
+
+static void testBackToBack(size_t threads, size_t chunk_size, int subscribers)
+{
+  MqttBroker broker(1883);
+  MqttFanoutExecutor executor(threads, chunk_size);
+  broker.setFanoutExecutor(&executor, 2);
+
+  std::vector<Test::Device> devices(subscribers + 1);
+  char id[16];
+  for(int i = 0; i <= subscribers; i++)
+  {
+    snprintf(id, sizeof(id), "dev%d", i);
+    devices[i].connect(broker, id);
+    if (i) devices[i].subscribe("broadcast/config");
+    broker.loop();
+  }
+  for(int i = 0; i < 10; i++) broker.loop();
+  for(auto& device: devices) device.receive();
+
+  std::vector<int> received(subscribers + 1, 0);
+  size_t errors = 0;
+  int sent = 0;
+  while(sent < Publishes)
+  {
+    // A varying number of publishes per loop: as many run() in a row
+    int burst = 1 + sent % 7;
+    for(int b = 0; b < burst and sent < Publishes; b++, sent++)
+      devices[0].publish("broadcast/config", "config " + std::to_string(sent) + std::string(sent % 50, '.'));
+    broker.loop();
+
+    for(int i = 1; i <= subscribers; i++)
+      devices[i].receive([&](const std::string& topic, const std::string& payload)
+      {
+        int n = received[i]++;
+        if (topic != "broadcast/config"
+            or payload != "config " + std::to_string(n) + std::string(n % 50, '.'))
+          errors++;
+      });
+  }
+  for(int i = 0; i < 10; i++) broker.loop();
+
+  size_t missing = 0;
+  for(int i = 1; i <= subscribers; i++)
+  {
+    devices[i].receive([&](const std::string&, const std::string&) { received[i]++; });
+    if (received[i] != Publishes) missing++;
+  }
+  printf("threads=%zu chunk=%zu subscribers=%d: %zu wrong payloads, %zu subscribers with missing or extra publishes\n",
+    threads, chunk_size, subscribers, errors, missing);
+  TEST_CHECK(errors == 0);
+  TEST_CHECK(missing == 0);
+}
+
+// Parallel deliveries are recorded with their payload, as the others
+static void testFlightRecords()
+{
+  const int Subscribers = 3;
+  Test::Fixture fixture("status", [](MqttBroker&) {}, Subscribers);
+  MqttFanoutExecutor executor(2, 1);
+  fixture.broker.setFanoutExecutor(&executor, 2);
+
+  MqttFlightRecorder::clear();
+  fixture.publisher.publish("status", "hello world");
+  fixture.loop();
+  TEST_CHECK(fixture.receive() == Subscribers);
+  int sent = 0;
+  for(size_t i = 0; i < MqttFlightRecorder::size(); i++)
+  {
+    const MqttFlightRecorder::Record& r = MqttFlightRecorder::at(i);
+    if (r.flags != MqttFlightRecorder::Sent or (r.header & 0xF0) != MqttMessage::Publish) continue;
+    sent++;
+    TEST_CHECK(r.length == 11);
+    TEST_CHECK(r.prefix_length == 11 and memcmp(r.prefix, "hello world", 11) == 0);
+  }
+  TEST_CHECK(sent == Subscribers);
+}
+
+void setup()
+{
+  testFlightRecords();
+  testBackToBack(1, 1, 64);
+  testBackToBack(4, 1, 64);
+  testBackToBack(4, 8, 64);
+  testBackToBack(8, 3, 64);
+  // Small jobs and many workers: most of them wake up after the job is done
+  testBackToBack(16, 1, 3);
+  Test::finish("FanoutExecutorTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,66 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * MqttCountingResource caps: once a part reaches its cap, the broker
+ * refuses new connections, subscriptions and oversized packets instead of
+ * crashing, and keeps serving the devices already connected.
+ */
+#include "../Test.h"
+#include <vector>
+
+static MqttCountingResource clients_memory(nullptr, 16384);
+static MqttCountingResource messages_memory(nullptr, 4096);
+
+static const int Devices = 200;
+
+void setup()
+{
+  MqttMemory::set(MqttMemory::Clients, &clients_memory);
+  MqttMemory::set(MqttMemory::Messages, &messages_memory);
+  {
+    MqttBroker broker(1883);
+    std::vector<Test::Device> devices(Devices);
+    char id[16];
+    for(int i = 0; i < Devices; i++)
+    {
+      snprintf(id, sizeof(id), "dev%d", i);
+      devices[i].connect(broker, id);
+      if (i == 1) devices[i].subscribe("big/#");
+      broker.loop();
+    }
+    for(int i = 0; i < 10; i++) broker.loop();
+    size_t connected = broker.clientsCount();
+    printf("connected %zu of %d, clients in use %zu, refusals %u\n",
+      connected, Devices, clients_memory.inUse(), clients_memory.refusals());
+    TEST_CHECK(connected > 0);
+    TEST_CHECK(connected < Devices);
+    TEST_CHECK(clients_memory.refusals() > 0);
+
+    // Subscriptions over the cap are refused, not allocated
+    char filter[32];
+    for(int i = 0; i < 200; i++)
+    {
+      snprintf(filter, sizeof(filter), "sensor/%d/#", i);
+      devices[0].subscribe(filter);
+      broker.loop();
+    }
+    TEST_CHECK(broker.budgetStats().refused_subscriptions > 0);
+
+    // A packet that does not fit the message cap closes its sender only
+    devices[2].publish("big/payload", std::string(2 * messages_memory.cap(), 'x'));
+    for(int i = 0; i < 10; i++) broker.loop();
+    TEST_CHECK(broker.clientsCount() == connected - 1);
+
+    size_t received = 0;
+    devices[1].receive();
+    devices[3].publish("big/small", "ok");
+    for(int i = 0; i < 10; i++) broker.loop();
+    devices[1].receive([&](const std::string&, const std::string&) { received++; });
+    TEST_CHECK(received == 1);
+    printf("overruns: clients %u, messages %u\n", clients_memory.overruns(), messages_memory.overruns());
+  }
+  Test::finish("MemoryCapTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,64 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Publishes larger than MqttRateLimit::byte_burst: they cost the whole
+ * burst, so they go through once the bucket is full instead of being
+ * dropped (Drop) or stalling the device (Delay) forever.
+ */
+#include "../Test.h"
+
+static const uint32_t BytesPerSec = 1000;
+static const uint32_t ByteBurst = 200;
+
+static void limit(MqttBroker& broker, MqttRateLimit::Action action)
+{
+  MqttRateLimit limit;
+  limit.bytes_per_sec = BytesPerSec;
+  limit.byte_burst = ByteBurst;
+  limit.action = action;
+  broker.setRateLimit(limit);
+}
+
+// Loops the broker until a publish is received or timeout_ms elapsed
+static bool publishBig(Test::Fixture& fixture, uint32_t timeout_ms)
+{
+  fixture.publisher.publish("big/payload", std::string(3 * ByteBurst, 'x'));
+  size_t received = 0;
+  uint32_t start = millis();
+  do
+  {
+    fixture.broker.loop();
+    received += fixture.receive();
+  } while(received == 0 and millis() - start < timeout_ms);
+  return received > 0;
+}
+
+static void testDrop()
+{
+  Test::Fixture fixture("big/#", [](MqttBroker& broker) { limit(broker, MqttRateLimit::Drop); });
+  TEST_CHECK(publishBig(fixture, 100));      // full bucket
+  TEST_CHECK(not publishBig(fixture, 20));   // empty bucket: dropped
+  TEST_CHECK(fixture.broker.rateStats().dropped == 1);
+  delay(1000 * ByteBurst / BytesPerSec + 50);
+  TEST_CHECK(publishBig(fixture, 100));      // refilled
+}
+
+static void testDelay()
+{
+  Test::Fixture fixture("big/#", [](MqttBroker& broker) { limit(broker, MqttRateLimit::Delay); });
+  TEST_CHECK(publishBig(fixture, 100));
+  // The second one waits for the bucket to refill, it is not stuck
+  uint32_t start = millis();
+  TEST_CHECK(publishBig(fixture, 2000));
+  TEST_CHECK(millis() - start < 1000);
+}
+
+void setup()
+{
+  testDrop();
+  testDelay();
+  Test::finish("RateLimitTest");
+}
+
+void loop()
+{
+}
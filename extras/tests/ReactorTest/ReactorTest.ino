@@ -0,0 +1,129 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * MqttReactorGroup (see MqttReactor.h) with devices spread over several
+ * reactors by the kernel: every subscriber gets the publishes of another
+ * reactor exactly once, and a publish is relayed only to the reactors
+ * having a subscriber that may want it.
+ */
+#include "../Test.h"
+#include <TinyMqtt/MqttReactor.h>
+#include <unistd.h>
+#include <vector>
+
+static const int Reactors = 3;
+static const int Subscribers = 12;
+
+// Reads the devices until done() or timeout_ms elapsed
+template<class Done>
+static bool wait(uint32_t timeout_ms, Done done)
+{
+  uint32_t start = millis();
+  while(not done())
+  {
+    if (millis() - start > timeout_ms) return false;
+    usleep(1000);
+  }
+  return true;
+}
+
+static size_t relayed(const MqttReactorGroup& group)
+{
+  size_t count = 0;
+  for(size_t i = 0; i < group.size(); i++) count += group[i].relayed();
+  return count;
+}
+
+void setup()
+{
+  uint16_t port = 20000 + getpid() % 10000;
+  MqttReactorGroup group(port, Reactors);
+  group.begin();
+
+  // Each device has its own connection, see TcpEpollTest
+  std::vector<TcpClient> links(Subscribers + 1);
+  std::vector<Test::Device> devices(Subscribers + 1);
+  Test::Device& publisher = devices[Subscribers];
+  std::vector<size_t> packets(devices.size());
+  char text[32];
+  for(size_t i = 0; i < devices.size(); i++)
+  {
+    TEST_CHECK(links[i].connect("127.0.0.1", port));
+    snprintf(text, sizeof(text), "dev%zu", i);
+    devices[i].connect(links[i], text);
+    snprintf(text, sizeof(text), "room/%zu/#", i);
+    if (&devices[i] != &publisher) devices[i].subscribe(text);
+  }
+  // Connack and suback: the subscriptions are known of every reactor
+  TEST_CHECK(wait(2000, [&]()
+  {
+    bool acked = true;
+    for(size_t i = 0; i < devices.size(); i++)
+    {
+      packets[i] += devices[i].receive();
+      acked = acked and packets[i] == (&devices[i] == &publisher ? 1u : 2u);
+    }
+    return acked;
+  }));
+  TEST_CHECK(group.clientsCount() == devices.size());
+  int busy = 0;
+  for(size_t i = 0; i < group.size(); i++) busy += group[i].clientsCount() > 0;
+  printf("clients per reactor:");
+  for(size_t i = 0; i < group.size(); i++) printf(" %zu", group[i].clientsCount());
+  printf("\n");
+  TEST_CHECK(busy > 1);
+
+  // Every subscriber gets its publish once, wherever it is
+  for(int round = 0; round < 3; round++)
+  {
+    for(int i = 0; i < Subscribers; i++)
+    {
+      snprintf(text, sizeof(text), "room/%d/temp", i);
+      publisher.publish(text, "21");
+    }
+    std::vector<size_t> received(Subscribers);
+    size_t wrong = 0;
+    TEST_CHECK(wait(2000, [&]()
+    {
+      size_t total = 0;
+      for(int i = 0; i < Subscribers; i++)
+      {
+        devices[i].receive([&](const std::string& topic, const std::string&)
+        {
+          snprintf(text, sizeof(text), "room/%d/temp", i);
+          if (topic == text) received[i]++; else wrong++;
+        });
+        total += received[i];
+      }
+      return total == Subscribers;
+    }));
+    usleep(20000);
+    for(int i = 0; i < Subscribers; i++) devices[i].receive([&](const std::string&, const std::string&) { wrong++; });
+    for(int i = 0; i < Subscribers; i++) TEST_CHECK(received[i] == 1);
+    TEST_CHECK(wrong == 0);
+  }
+
+  // No reactor wants these: nothing relayed
+  size_t before = relayed(group);
+  for(int i = 0; i < 100; i++) publisher.publish("nobody/home", "x");
+  usleep(100000);
+  TEST_CHECK(relayed(group) == before);
+
+  // Unless a filter starts with a wildcard
+  devices[0].subscribe("+/home");
+  TEST_CHECK(wait(2000, [&]() { return devices[0].receive() == 1; }));
+  size_t received = 0;
+  publisher.publish("nobody/home", "x");
+  TEST_CHECK(wait(2000, [&]()
+  {
+    devices[0].receive([&](const std::string& topic, const std::string&) { received += topic == "nobody/home"; });
+    return received == 1;
+  }));
+  printf("relayed %zu publishes\n", relayed(group));
+
+  group.stop();
+  Test::finish("ReactorTest");
+}
+
+void loop()
+{
+}
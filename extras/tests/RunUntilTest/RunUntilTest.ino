@@ -0,0 +1,57 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * MqttBroker::runUntil() when loop() ends past the deadline, here in a slow
+ * callback: it must return, not wait for the wrapped remaining time.
+ */
+#include "../Test.h"
+#include <signal.h>
+#include <unistd.h>
+
+static const uint32_t SlowMs = 50;
+
+static void slowCallback(const MqttClient*, const Topic&, const char*, size_t)
+{
+  delay(SlowMs);
+}
+
+static void stuck(int)
+{
+  static const char verdict[] = "runUntil() did not return\nRunUntilTest: FAILED\n";
+  (void)write(1, verdict, sizeof(verdict) - 1);
+  _exit(1);
+}
+
+void setup()
+{
+  signal(SIGALRM, stuck);
+  alarm(10);
+  MqttBroker broker(1883);
+  broker.begin();  // waits with epoll, as in production
+  MqttClient slow(&broker, "slow");
+  slow.setCallback(slowCallback);
+  slow.subscribe("slow/#");
+
+  Test::Device device;
+  device.connect(broker, "device");
+  for(int i = 0; i < 10; i++) broker.loop();
+  device.receive();
+
+  device.publish("slow/down", "x");
+  uint32_t start = millis();
+  broker.runUntil(start + SlowMs / 5);
+  uint32_t elapsed = millis() - start;
+  printf("runUntil returned after %u ms\n", elapsed);
+  TEST_CHECK(elapsed >= SlowMs);
+  TEST_CHECK(elapsed < 1000);
+
+  // Without anything to do, it still returns at the deadline
+  start = millis();
+  broker.runUntil(start + 20);
+  elapsed = millis() - start;
+  TEST_CHECK(elapsed >= 20 and elapsed < 1000);
+  Test::finish("RunUntilTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,135 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Shared memory ring (see ShmRing.h): a reader lapped by a fast writer
+ * never gets a torn record and accounts for every message (read + lost ==
+ * written); the broker writes the publishes in order; the ring is private
+ * to the user of the broker by default.
+ */
+#include "../Test.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+
+static const uint32_t Messages = 200000;
+
+struct Check
+{
+  uint64_t read = 0;
+  uint64_t torn = 0;
+  uint64_t disordered = 0;
+  uint32_t last = 0;
+};
+
+// Payload: the sequence number repeated, topic: t/<sequence % 10>
+static size_t makePayload(uint32_t sequence, char* buf)
+{
+  size_t repeats = 1 + sequence % 40;
+  for(size_t i = 0; i < repeats; i++) snprintf(buf + 8 * i, 9, "%08u", sequence);
+  return 8 * repeats;
+}
+
+static void onMessage(void* context, const char* topic, uint16_t topic_len, const char* payload, size_t length)
+{
+  Check& check = *static_cast<Check*>(context);
+  check.read++;
+  char expected[8 * 40 + 1];
+  uint32_t sequence = length >= 8 ? strtoul(std::string(payload, 8).c_str(), nullptr, 10) : 0;
+  char expected_topic[8];
+  snprintf(expected_topic, sizeof(expected_topic), "t/%u", sequence % 10);
+  if (length != makePayload(sequence, expected) or memcmp(payload, expected, length)
+      or topic_len != strlen(expected_topic) or memcmp(topic, expected_topic, topic_len))
+    check.torn++;
+  else if (check.read > 1 and sequence <= check.last)
+    check.disordered++;
+  check.last = sequence;
+}
+
+static void testLapped(const char* name)
+{
+  MqttShmWriter writer;
+  TEST_CHECK(writer.open(name, 16384));
+  MqttShmReader reader;
+  TEST_CHECK(reader.open(name));
+
+  std::atomic<bool> done{false};
+  std::thread producer([&]()
+  {
+    char payload[8 * 40 + 1];
+    char topic[8];
+    for(uint32_t sequence = 0; sequence < Messages; sequence++)
+    {
+      snprintf(topic, sizeof(topic), "t/%u", sequence % 10);
+      writer.write(topic, strlen(topic), payload, makePayload(sequence, payload));
+      // Paced in the first half, so the reader keeps up, then as fast as
+      // possible, so it is lapped
+      if (sequence < Messages / 2 and sequence % 16 == 15)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    done = true;
+  });
+
+  Check check;
+  while(not done) reader.poll(onMessage, &check);
+  producer.join();
+  reader.poll(onMessage, &check);
+
+  printf("lapped: read %llu, lost %llu, torn %llu, disordered %llu\n",
+    static_cast<unsigned long long>(check.read), static_cast<unsigned long long>(reader.lost()),
+    static_cast<unsigned long long>(check.torn), static_cast<unsigned long long>(check.disordered));
+  TEST_CHECK(check.torn == 0);
+  TEST_CHECK(check.disordered == 0);
+  TEST_CHECK(check.read + reader.lost() == Messages);
+  TEST_CHECK(check.read > 0);
+  TEST_CHECK(reader.lost() > 0);  // else the test did not lap the reader
+}
+
+static void testBroker(const char* name)
+{
+  MqttBroker broker(1883);
+  TEST_CHECK(broker.shareMemory(name, 1 << 16));
+  MqttShmReader reader;
+  TEST_CHECK(reader.open(name));
+
+  // Readable by the user of the broker only
+  int fd = shm_open(name, O_RDONLY, 0);
+  struct stat st;
+  TEST_CHECK(fd >= 0 and fstat(fd, &st) == 0 and (st.st_mode & 0777) == 0600);
+  if (fd >= 0) close(fd);
+
+  Test::Device device;
+  device.connect(broker, "device");
+  for(int i = 0; i < 10; i++) broker.loop();
+  char payload[8 * 40 + 1];
+  char topic[8];
+  for(uint32_t sequence = 0; sequence < 100; sequence++)
+  {
+    snprintf(topic, sizeof(topic), "t/%u", sequence % 10);
+    device.publish(topic, std::string(payload, makePayload(sequence, payload)));
+    broker.loop();
+  }
+  for(int i = 0; i < 10; i++) broker.loop();
+
+  Check check;
+  reader.poll(onMessage, &check);
+  TEST_CHECK(check.read == 100);
+  TEST_CHECK(check.torn == 0 and check.disordered == 0);
+  TEST_CHECK(reader.lost() == 0);
+}
+
+void setup()
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/tinymqtt-test-%d", getpid());
+  testLapped(name);
+  shm_unlink(name);
+  testBroker(name);
+  shm_unlink(name);
+  Test::finish("ShmRingTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,50 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * MqttBroker::suppressUnchanged() with more topics than the StringIndexer
+ * has indexes (255) and than MqttConfig::SuppressedTopics: a publish is
+ * only suppressed by the previous payload of its own topic, and the
+ * suppression state stays bounded.
+ */
+#include "../Test.h"
+
+static const int Topics = 400;
+
+// Publishes "ON" on dev/<first..last-1>/state, returns the copies forwarded
+static size_t publish(Test::Fixture& fixture, int first, int last)
+{
+  char topic[32];
+  for(int i = first; i < last; i++)
+  {
+    snprintf(topic, sizeof(topic), "dev/%d/state", i);
+    fixture.publisher.publish(topic, "ON");
+    fixture.broker.loop();
+  }
+  fixture.loop();
+  return fixture.receive();
+}
+
+void setup()
+{
+  Test::Fixture fixture("dev/#", [](MqttBroker& broker) { broker.suppressUnchanged("dev/#"); });
+
+  // Same payload on distinct topics: nothing is suppressed
+  TEST_CHECK(publish(fixture, 0, Topics) == Topics);
+
+  // Republished on the topics still remembered: all suppressed
+  int recent = MqttConfig::SuppressedTopics / 2;
+  TEST_CHECK(publish(fixture, Topics - recent, Topics) == 0);
+
+  // Topics forgotten (least recently published): forwarded again
+  TEST_CHECK(publish(fixture, 0, 10) == 10);
+
+  // The suppression state does not keep topics interned
+  StringIndexer::purge();
+  TEST_CHECK(StringIndexer::count() < 10);
+  printf("suppressed %u, strings %u\n", fixture.broker.suppressedCount(), StringIndexer::count());
+
+  Test::finish("SuppressionTest");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,94 @@
+// vim: ts=2 sw=2 expandtab
+/***
+ * Epoll transport (see TcpEpoll.h) with real sockets: devices connected by
+ * TCP and by a Unix domain socket get the publishes, and a subscriber that
+ * stops reading is closed once its output backlog is full, instead of
+ * being buffered without limit.
+ */
+#include "../Test.h"
+#include <unistd.h>
+
+static const size_t Payload = 1000;
+
+// Loops the broker until done() or timeout_ms elapsed
+template<class Done>
+static bool run(MqttBroker& broker, uint32_t timeout_ms, Done done)
+{
+  uint32_t start = millis();
+  while(not done())
+  {
+    if (millis() - start > timeout_ms) return false;
+    broker.loop();
+  }
+  return true;
+}
+
+void setup()
+{
+  uint16_t port = 20000 + getpid() % 10000;
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/tinymqtt-test-%d.sock", getpid());
+
+  MqttBroker broker(port);
+  broker.begin();
+  TEST_CHECK(broker.listen(path));
+
+  Test::Device publisher, tcp, unix_socket, stalled;
+  publisher.connect(broker, "publisher");
+  TcpClient clients[3];  // connect() closes what a client was connected to
+  TEST_CHECK(clients[0].connect("127.0.0.1", port));
+  tcp.connect(clients[0], "tcp");
+  TEST_CHECK(clients[1].connect(path, 0));
+  unix_socket.connect(clients[1], "unix");
+  TEST_CHECK(clients[2].connect("127.0.0.1", port));
+  stalled.connect(clients[2], "stalled");
+  for(auto device: { &tcp, &unix_socket, &stalled }) device->subscribe("flood/#");
+  TEST_CHECK(run(broker, 2000, [&]() { return broker.clientsCount() == 4; }));
+  for(int i = 0; i < 100; i++) broker.loop();
+  for(auto device: { &publisher, &tcp, &unix_socket, &stalled }) device->receive();
+
+  // Round trip through both kinds of sockets
+  size_t tcp_received = 0, unix_received = 0;
+  publisher.publish("flood/hello", "world");
+  TEST_CHECK(run(broker, 2000, [&]()
+  {
+    tcp.receive([&](const std::string& topic, const std::string& payload)
+      { tcp_received += topic == "flood/hello" and payload == "world"; });
+    unix_socket.receive([&](const std::string&, const std::string&) { unix_received++; });
+    return tcp_received == 1 and unix_received == 1;
+  }));
+
+  // stalled never reads again: far more than the kernel buffers and the
+  // backlog of the broker can hold
+  MqttMetrics::reset();
+  std::string payload(Payload, 'x');
+  uint32_t published = 0;
+  bool closed = run(broker, 20000, [&]()
+  {
+    publisher.publish("flood/data", payload);
+    published++;
+    tcp.receive();
+    unix_socket.receive();
+    return broker.clientsCount() == 3;
+  });
+  MqttMetrics::Snapshot snapshot;
+  MqttMetrics::snapshot(snapshot);
+  printf("stalled subscriber closed after %u publishes, slow_clients %u\n",
+    published, snapshot.counters[MqttMetrics::SlowClients]);
+  TEST_CHECK(closed);
+  TEST_CHECK(snapshot.counters[MqttMetrics::SlowClients] == 1);
+
+  // The others are still served
+  tcp_received = 0;
+  publisher.publish("flood/hello", "world");
+  TEST_CHECK(run(broker, 2000, [&]()
+  {
+    tcp.receive([&](const std::string& topic, const std::string&) { tcp_received += topic == "flood/hello"; });
+    return tcp_received == 1;
+  }));
+  Test::finish("TcpEpollTest");
+}
+
+void loop()
+{
+}
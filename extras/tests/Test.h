@@ -0,0 +1,172 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <TinyMqtt/TinyMqtt.h>
+
+/***
+ * Helpers shared by the host tests (see README.md). A failed check prints
+ * its location, Test::finish() prints the verdict and sets the exit code.
+ */
+#define TEST_CHECK(cond) Test::check((cond), #cond, __FILE__, __LINE__)
+
+namespace Test
+{
+  inline uint32_t& failures() { static uint32_t count = 0; return count; }
+
+  inline bool check(bool ok, const char* what, const char* file, int line)
+  {
+    if (not ok)
+    {
+      printf("FAIL %s:%d: %s\n", file, line, what);
+      failures()++;
+    }
+    return ok;
+  }
+
+  inline void finish(const char* name)
+  {
+    printf("%s: %s\n", name, failures() ? "FAILED" : "OK");
+    fflush(stdout);
+    exit(failures() ? 1 : 0);
+  }
+
+  // Client end of an in-memory connection (see MqttBroker::connectMemory)
+  struct Device
+  {
+    TcpClient link;
+    std::string inbox;  // bytes of incomplete packets
+
+    void send(uint8_t header, const std::string& body)
+    {
+      std::string packet(1, static_cast<char>(header));
+      size_t length = body.size();
+      do
+      {
+        uint8_t byte = length & 0x7F;
+        length >>= 7;
+        packet += static_cast<char>(length ? byte | 0x80 : byte);
+      } while(length);
+      packet += body;
+      link.write(packet.data(), packet.size());
+    }
+
+    static std::string str(const char* s)
+    {
+      size_t len = strlen(s);
+      return std::string(1, static_cast<char>(len >> 8)) + static_cast<char>(len & 0xFF) + s;
+    }
+
+    void connect(MqttBroker& broker, const char* id) { connect(broker.connectMemory(), id); }
+
+    void connect(const TcpClient& client, const char* id)
+    {
+      link = client;
+      send(MqttMessage::Connect, str("MQTT") + '\x04' + '\x02' + '\x00' + '\x3C' + str(id));
+    }
+
+    void subscribe(const char* filter)
+    {
+      send(MqttMessage::Subscribe | 2, std::string("\x00\x01", 2) + str(filter) + '\x00');
+    }
+
+    void publish(const char* topic, const std::string& payload)
+    {
+      send(MqttMessage::Publish, str(topic) + payload);
+    }
+
+    /** Reads the packets received, calls on_publish(topic, payload) for
+        each publish, returns the number of packets read */
+    template<class OnPublish>
+    size_t receive(OnPublish on_publish)
+    {
+      return receiveRaw([&](const char* topic, size_t topic_len, const char* payload, size_t len)
+        { on_publish(std::string(topic, topic_len), std::string(payload, len)); });
+    }
+
+    size_t receive() { return receiveRaw([](const char*, size_t, const char*, size_t) {}); }
+
+    /** As receive(), without copies: on_publish(topic, topic_len, payload,
+        len) points into the inbox (see FanoutBench) */
+    template<class OnPublish>
+    size_t receiveRaw(OnPublish on_publish)
+    {
+      char buf[4096];
+      int len;
+      while((len = link.read(reinterpret_cast<uint8_t*>(buf), sizeof(buf))) > 0)
+        inbox.append(buf, len);
+
+      size_t packets = 0;
+      size_t pos = 0;
+      while(pos + 2 <= inbox.size())
+      {
+        size_t length = 0;
+        size_t shift = 0;
+        size_t p = pos + 1;
+        while(p < inbox.size())
+        {
+          uint8_t byte = inbox[p++];
+          length |= static_cast<size_t>(byte & 0x7F) << shift;
+          shift += 7;
+          if ((byte & 0x80) == 0) break;
+        }
+        if (p + length > inbox.size()) break;
+        if ((inbox[pos] & 0xF0) == MqttMessage::Publish)
+        {
+          size_t topic = (static_cast<uint8_t>(inbox[p]) << 8) | static_cast<uint8_t>(inbox[p+1]);
+          on_publish(inbox.data() + p + 2, topic, inbox.data() + p + 2 + topic, length - 2 - topic);
+        }
+        packets++;
+        pos = p + length;
+      }
+      inbox.erase(0, pos);
+      return packets;
+    }
+  };
+
+  /** A broker with a publisher and count subscribers to filter, connected
+      and acknowledged. configure(broker) runs first, to set the broker up
+      (rate limit, suppression, gateway...) */
+  struct Fixture
+  {
+    MqttBroker broker{1883};
+    Device publisher;
+    std::vector<Device> subscribers;
+    size_t received = 0;   // publishes read by receive()
+
+    template<class Configure>
+    Fixture(const char* filter, Configure configure, size_t count = 1) : subscribers(count)
+    {
+      configure(broker);
+      publisher.connect(broker, "publisher");
+      char id[32];
+      for(size_t i = 0; i < count; i++)
+      {
+        snprintf(id, sizeof(id), "subscriber%zu", i);
+        subscribers[i].connect(broker, id);
+        subscribers[i].subscribe(filter);
+      }
+      loop();
+      publisher.receive();
+      for(auto& subscriber: subscribers) subscriber.receive();
+    }
+
+    explicit Fixture(const char* filter) : Fixture(filter, [](MqttBroker&) {}) {}
+
+    void loop(int times = 10) { for(int i = 0; i < times; i++) broker.loop(); }
+
+    /** Reads the subscribers, returns the publishes received since the
+        previous call */
+    size_t receive()
+    {
+      size_t before = received;
+      for(auto& subscriber: subscribers)
+        subscriber.receive([&](const std::string&, const std::string&) { received++; });
+      return received - before;
+    }
+  };
+}
@@ -19,9 +19,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#ifndef TINY_MQTT_EPOLL
 #include <ArduinoIoTCloud.h>
+#endif
 #include "Arduino_MQTT_Gateway.h"
+#ifndef TINY_MQTT_EPOLL
 #include <ESPmDNS.h>
+#endif
+#include <bitset>
+#include <float.h>
 
 namespace AMG {
 
@@ -31,10 +37,102 @@ namespace AMG {
 // In other words, this ensures that cloud changes always win over device states.
 constexpr unsigned long IGNORE_STATES_FOR = 500;
 
+enum class JsonField { Found, Missing, Unsupported };
+
+static const char* skipJsonSpaces(const char* p, const char* end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  return p;
+}
+
+// p is after the opening quote, returns the closing quote or nullptr
+static const char* skipJsonString(const char* p, const char* end, bool& escaped)
+{
+  static const char special[] = { '"', '\\' };
+  while (p < end) {
+    p += TextScan::findAnyOf(p, end - p, special, 2);
+    if (p >= end) return nullptr;
+    if (*p == '"') return p;
+    escaped = true;
+    p += 2;
+  }
+  return nullptr;
+}
+
+// Returns the end of the value starting at p, or nullptr
+static const char* skipJsonValue(const char* p, const char* end)
+{
+  static const char structure[] = { '"', '{', '}', '[', ']' };
+  static const char scalar_end[] = { ',', '}', ']', ' ', '\t', '\r', '\n' };
+  bool escaped = false;
+  if (p >= end) return nullptr;
+  if (*p == '"') {
+    p = skipJsonString(p + 1, end, escaped);
+    return p ? p + 1 : nullptr;
+  }
+  if (*p != '{' && *p != '[') return p + TextScan::findAnyOf(p, end - p, scalar_end, sizeof(scalar_end));
+
+  int depth = 0;
+  while (p < end) {
+    p += TextScan::findAnyOf(p, end - p, structure, sizeof(structure));
+    if (p >= end) return nullptr;
+    if (*p == '"') {
+      p = skipJsonString(p + 1, end, escaped);
+      if (!p) return nullptr;
+    } else if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (--depth == 0) {
+      return p + 1;
+    }
+    p++;
+  }
+  return nullptr;
+}
+
+// Locates the value of a top-level field of a JSON object without parsing the
+// whole payload, jumping between structural characters with TextScan (SIMD on
+// hosts). Unusual input (escaped keys, malformed JSON) is left to ArduinoJson.
+static JsonField findJsonField(const char* json, size_t len, const char* field, const char*& value, size_t& value_len)
+{
+  const char* end = json + len;
+  const size_t field_len = strlen(field);
+  const char* p = skipJsonSpaces(json, end);
+  if (p == end || *p != '{') return JsonField::Unsupported;
+  p = skipJsonSpaces(p + 1, end);
+  if (p < end && *p == '}') return JsonField::Missing;
+
+  while (p < end) {
+    if (*p != '"') return JsonField::Unsupported;
+    bool escaped = false;
+    const char* key = p + 1;
+    const char* key_end = skipJsonString(key, end, escaped);
+    if (!key_end || escaped) return JsonField::Unsupported;
+    p = skipJsonSpaces(key_end + 1, end);
+    if (p == end || *p != ':') return JsonField::Unsupported;
+    p = skipJsonSpaces(p + 1, end);
+    const char* v = p;
+    p = skipJsonValue(p, end);
+    if (!p || p == v) return JsonField::Unsupported;
+    if ((size_t)(key_end - key) == field_len && memcmp(key, field, field_len) == 0) {
+      value = v;
+      value_len = p - v;
+      return JsonField::Found;
+    }
+    p = skipJsonSpaces(p, end);
+    if (p < end && *p == '}') return JsonField::Missing;
+    if (p == end || *p != ',') return JsonField::Unsupported;
+    p = skipJsonSpaces(p + 1, end);
+  }
+  return JsonField::Unsupported;
+}
+
 void Gateway::loop()
 {
   // Wait until network connection is established before initializing our MQTT broker
   if (!_started) {
+#ifdef TINY_MQTT_EPOLL
+    return;  // host builds have no network to wait for, see attach()
+#else
     if (ArduinoCloud.getConnection()->check() != NetworkConnectionState::CONNECTED) {
       return;
     }
@@ -59,51 +157,121 @@ void Gateway::loop()
     Serial.println(")");
 
     // Start the MQTT broker
-    _mqtt_broker = new MqttBroker(_port);
+    attach(new MqttBroker(_port));
     _mqtt_broker->begin();
-
-    // Start listening for incoming messages
-    _mqtt_client = new TinyMqttClient(_mqtt_broker);
-    _mqtt_client->setCallback(&Gateway::onMsg);
-    _mqtt_client->subscribe("#");
-
-    _started = true;
+#endif
   }
 
   _mqtt_broker->loop();
   _mqtt_client->loop();
+  syncProperties();
+}
+
+void Gateway::attach(MqttBroker* broker)
+{
+  _mqtt_broker = broker;
+  _mqtt_broker->setRateLimit(_rate_limit);
+  _mqtt_broker->publishSysStats(_sys_period);
+  _mqtt_broker->setClientBudget(_client_budget);
+  _mqtt_broker->setMemoryPressure(_memory_pressure);
+
+  // Start listening for incoming messages
+  _mqtt_client = new TinyMqttClient(_mqtt_broker);
+  _mqtt_client->setBatchCallback(&Gateway::onBatch);
+  _mqtt_client->subscribe("#");
+
+  _started = true;
+}
 
+void Gateway::syncProperties()
+{
   // Check if any variable has changed since last time we saw it.
   // This method is a bit resource-intensive, but since ArduinoIoTCloud does not 
   // provide an accessible API for this, we can't rely on its callbacks or timestamps
   // and we need to keep a copy of the values ourselves.
-  for (Property* p : ArduinoMQTTGateway._properties) {
-    if (p->hasChanged()) {
-#ifdef DEBUG_MQTT_GATEWAY
-      Serial.println("Property has changed since last loop!");
+  TM_PROFILE_SCOPE(MqttProfiler::GatewayScan);
+  for (Property* p : _polled) {
+    if (p->hasChanged()) syncToMQTT(p);
+  }
+
+  // Bool properties: pack the current values 32 at a time, and only visit
+  // the bits that differ from the last seen values
+  for (size_t w = 0; w < _bool_seen.size(); w++) {
+    size_t base = w * 32;
+    size_t count = _bools.size() - base;
+    if (count > 32) count = 32;
+    uint32_t current = 0;
+    for (size_t b = 0; b < count; b++) {
+      current |= static_cast<uint32_t>(*_bools[base + b]->_var) << b;
+    }
+    uint32_t changed = current ^ _bool_seen[w];
+    while (changed) {
+      syncToMQTT(_bools[base + __builtin_ctz(changed)]);
+      changed &= changed - 1;
+    }
+  }
+}
+
+void Gateway::syncToMQTT(Property* p)
+{
+  TM_TRACE_SCOPE("property_sync");
+#if DEBUG_MQTT_GATEWAY
+  Serial.println("Property has changed since last loop!");
 #endif
-      // This means it was changed from cloud or from our loop(), so we need to sync
-      // it to the MQTT device.
-      if (p->_command_topic != nullptr) {
-#ifdef DEBUG_MQTT_GATEWAY
-        Serial.print("-> publishing MQTT update to ");
-        Serial.print(p->_command_topic);
-        Serial.print("; payload = ");
-        Serial.println(p->getCommandPayload().c_str());
+  // This means it was changed from cloud or from our loop(), so we need to sync
+  // it to the MQTT device.
+  if (p->_command_topic != nullptr) {
+    char buf[Property::CommandLength];
+    const char* payload = p->getCommandPayload(buf);
+#if DEBUG_MQTT_GATEWAY
+    Serial.print("-> publishing MQTT update to ");
+    Serial.print(p->_command_topic);
+    Serial.print("; payload = ");
+    Serial.println(payload);
 #endif
-        _mqtt_client->publish(p->_command_topic, p->getCommandPayload());
-      }
-      p->updateLastSeen();
-    }
+    _mqtt_client->publish(p->_command_topic, payload);
+  }
+  p->updateLastSeen();
+}
+
+bool Gateway::waitForEvent(uint32_t timeout_ms)
+{
+  if (!_started) {
+    delay(timeout_ms);
+    return false;
+  }
+  return _mqtt_broker->waitForEvent(timeout_ms);
+}
+
+void Gateway::onBatch(const TinyMqttClient* client, const TinyMqttClient::Delivery* deliveries, size_t count)
+{
+  // Topics are indexed on one byte: walk backwards and keep the first seen
+  std::bitset<256> seen;
+  auto& latest = ArduinoMQTTGateway._latest;  // keeps its capacity
+  latest.assign(count, false);
+  for (size_t i = count; i-- > 0;) {
+    uint8_t index = deliveries[i].topic.getIndex();
+    latest[i] = !seen[index];
+    seen[index] = true;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (!latest[i]) continue;
+#ifdef TINY_MQTT_TRACE
+    MqttTraceMessage traced(deliveries[i].trace_message);
+#endif
+    onMsg(client, deliveries[i].topic, deliveries[i].payload, deliveries[i].length);
   }
 }
 
 void Gateway::onMsg(const TinyMqttClient* client, const Topic& topic, const char* payload, size_t len)
 {
+  TM_TRACE_SCOPE("gateway_dispatch");
+#if DEBUG_MQTT_GATEWAY
   Serial.print("--> received [");
   Serial.print(topic.c_str());
   Serial.print("]: ");
   Serial.println(payload);
+#endif
 
   bool deserializedJSON = false;
   bool deserializionFailed = false;
@@ -112,7 +280,7 @@ void Gateway::onMsg(const TinyMqttClient* client, const Topic& topic, const char
   for (Property* p : ArduinoMQTTGateway._properties) {
     if (strcmp(topic.c_str(), p->_state_topic) != 0) continue;
     if ((millis() - p->_last_seen) < IGNORE_STATES_FOR) {
-#ifdef DEBUG_MQTT_GATEWAY
+#if DEBUG_MQTT_GATEWAY
       Serial.print("millis() = ");
       Serial.print(millis());
       Serial.print("; p->_last_seen = ");
@@ -124,6 +292,20 @@ void Gateway::onMsg(const TinyMqttClient* client, const Topic& topic, const char
        
     // If a JSON field was specified, extract payload from it
     if (p->_state_json_field != nullptr) {
+      // Fast path: only the value of the field is parsed
+      const char* value;
+      size_t value_len;
+      JsonField found = findJsonField(payload, len, p->_state_json_field, value, value_len);
+      if (found == JsonField::Missing) continue;
+      if (found == JsonField::Found) {
+        StaticJsonDocument<200> field;
+        if (!deserializeJson(field, value, value_len)) {
+          TM_TRACE_SCOPE("property_update");
+          p->updateFromMQTT_JSON(field.as<JsonVariant>());
+          continue;
+        }
+      }
+
       if (!deserializedJSON && !deserializionFailed) {
         DeserializationError error = deserializeJson(doc, payload);
         if (error) {
@@ -135,13 +317,28 @@ void Gateway::onMsg(const TinyMqttClient* client, const Topic& topic, const char
       }
       if (deserializionFailed) continue;
 
+      TM_TRACE_SCOPE("property_update");
       p->updateFromMQTT_JSON(doc[p->_state_json_field]);
     } else {
+      TM_TRACE_SCOPE("property_update");
       p->updateFromMQTT(payload);
     }
   }
 }
 
+bool BoolProperty::hasChanged() const
+{
+  return ((ArduinoMQTTGateway._bool_seen[_bit / 32] >> (_bit % 32)) & 1) != *_var;
+}
+
+void BoolProperty::updateLastSeen()
+{
+  uint32_t mask = 1u << (_bit % 32);
+  uint32_t& word = ArduinoMQTTGateway._bool_seen[_bit / 32];
+  word = *_var ? (word | mask) : (word & ~mask);
+  _last_seen = millis();
+}
+
 void BoolProperty::updateFromMQTT(const char* payload)
 {
   if (strcmp(payload, _state_on) == 0) {
@@ -183,6 +380,16 @@ void FloatProperty::updateFromMQTT(const char* payload)
   updateLastSeen();
 }
 
+const char* FloatProperty::getCommandPayload(char* buf) const
+{
+  // sign, integer digits, point, 6 decimals and the terminator
+  static_assert(1 + (FLT_MAX_10_EXP + 1) + 1 + 6 + 1 <= CommandLength, "-FLT_MAX does not fit with %f");
+  int len = snprintf(buf, CommandLength, "%f", *_var);
+  if (len < 0 || len >= static_cast<int>(CommandLength))
+    snprintf(buf, CommandLength, "%g", *_var);  // not a number the buffer can hold
+  return buf;
+}
+
 void FloatProperty::updateFromMQTT_JSON(const JsonVariant& payload)
 {
   if (payload.is<float>()) {
@@ -193,14 +400,14 @@ void FloatProperty::updateFromMQTT_JSON(const JsonVariant& payload)
 
 void StringProperty::updateFromMQTT(const char* payload)
 {
-  *_var = String(payload);
+  *_var = payload;  // reuses the buffer of the String
   updateLastSeen();
 }
 
 void StringProperty::updateFromMQTT_JSON(const JsonVariant& payload)
 {
   if (payload.is<const char*>()) {
-    *_var = payload.as<String>();
+    *_var = payload.as<const char*>();
     updateLastSeen();
   }
 }
@@ -24,12 +24,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <vector>
 
+#ifndef DEBUG_MQTT_GATEWAY
 #define DEBUG_MQTT_GATEWAY 0
+#endif
 
 namespace AMG {
 
 class Property {
   public:
+  TINY_MQTT_ALLOCATED_IN(MqttMemory::Gateway)
+
   Property& setStateTopic(const char* topic) { _state_topic = topic; return *this; };
   Property& setCommandTopic(const char* topic) { _command_topic = topic; return *this; };
   Property& setStatePayloadJSONField(const char* field) { _state_json_field = field; return *this; };  
@@ -43,11 +47,13 @@ class Property {
   };
 
   protected:
-  virtual void updateFromMQTT(const char* payload);
-  virtual void updateFromMQTT_JSON(const JsonVariant& payload);
-  virtual bool hasChanged() const;
-  virtual void updateLastSeen();
-  virtual std::string getCommandPayload() const;
+  virtual void updateFromMQTT(const char* payload) = 0;
+  virtual void updateFromMQTT_JSON(const JsonVariant& payload) = 0;
+  virtual bool hasChanged() const = 0;
+  virtual void updateLastSeen() = 0;
+  // Returns the payload, written in buf (CommandLength bytes) if needed
+  virtual const char* getCommandPayload(char* buf) const = 0;
+  static const size_t CommandLength = 48;  // -FLT_MAX with %f takes 47
   const char* _state_topic      = nullptr;
   const char* _command_topic    = nullptr;
   const char* _state_json_field = nullptr;
@@ -56,22 +62,28 @@ class Property {
   friend class Gateway;
 };
 
+// Last seen values of all the bool properties, one bit each
+using BoolBits = std::vector<uint32_t, MqttAllocator<uint32_t, MqttMemory::Gateway>>;
+
+// The last seen value is bit _bit of the gateway's BoolBits: a relay costs
+// no more than a property with its own copy of the value
 class BoolProperty : public Property {
   public:
-  BoolProperty(bool& var) : _var(&var) {};
+  BoolProperty(bool& var, uint16_t bit) : _var(&var), _bit(bit) {};
   BoolProperty& setStatePayload(const char* on, const char* off) { _state_on = on; _state_off = off; return *this; };
   BoolProperty& setCommandPayload(const char* on, const char* off) { _cmd_on = on; _cmd_off = off; return *this; };
 
   protected:
   void updateFromMQTT(const char* payload);
   void updateFromMQTT_JSON(const JsonVariant& payload);
-  bool hasChanged() const { return _last_seen_value != *_var; };
-  void updateLastSeen() { _last_seen_value = *_var; _last_seen = millis(); };
-  std::string getCommandPayload() const { return std::string(*_var ? _cmd_on : _cmd_off); };
+  bool hasChanged() const;
+  void updateLastSeen();
+  const char* getCommandPayload(char*) const { return *_var ? _cmd_on : _cmd_off; };
 
   private:
+  friend class Gateway;
   bool* _var;
-  bool _last_seen_value;
+  uint16_t _bit;
   const char* _state_on   = "on";
   const char* _state_off  = "off";
   const char* _cmd_on     = "on";
@@ -87,7 +99,7 @@ class IntProperty : public Property {
   void updateFromMQTT_JSON(const JsonVariant& payload);
   bool hasChanged() const { return _last_seen_value != *_var; };
   void updateLastSeen() { _last_seen_value = *_var; _last_seen = millis(); };
-  std::string getCommandPayload() const { return std::to_string(*_var); };
+  const char* getCommandPayload(char* buf) const { snprintf(buf, CommandLength, "%d", *_var); return buf; };
 
   private:
   int* _var;
@@ -103,7 +115,7 @@ class FloatProperty : public Property {
   void updateFromMQTT_JSON(const JsonVariant& payload);
   bool hasChanged() const { return _last_seen_value != *_var; };
   void updateLastSeen() { _last_seen_value = *_var; _last_seen = millis(); };
-  std::string getCommandPayload() const { return std::to_string(*_var); };
+  const char* getCommandPayload(char* buf) const;
 
   private:
   float* _var;
@@ -119,7 +131,7 @@ class StringProperty : public Property {
   void updateFromMQTT_JSON(const JsonVariant& payload);
   bool hasChanged() const { return _last_seen_value != *_var; };
   void updateLastSeen() { _last_seen_value = *_var; _last_seen = millis(); };
-  std::string getCommandPayload() const { return std::string(_var->c_str()); };
+  const char* getCommandPayload(char*) const { return _var->c_str(); };
 
   private:
   String* _var;
@@ -128,38 +140,94 @@ class StringProperty : public Property {
 
 class Gateway {
   public:
+  // At most 65536 bool properties
   BoolProperty& add(bool& var) {
-    auto p = new BoolProperty(var);
+    size_t bit = _bools.size();
+    if (bit % 32 == 0) _bool_seen.push_back(0);
+    auto p = new BoolProperty(var, static_cast<uint16_t>(bit));
     _properties.push_back(p);
+    _bools.push_back(p);
     return *p;
   };
   IntProperty& add(int& var)    {
     auto p = new IntProperty(var);
     _properties.push_back(p);
+    _polled.push_back(p);
     return *p;
   };
   FloatProperty& add(float& var)  {
     auto p = new FloatProperty(var);
     _properties.push_back(p);
+    _polled.push_back(p);
     return *p;
   };
   StringProperty& add(String& var) {
     auto p = new StringProperty(var);
     _properties.push_back(p);
+    _polled.push_back(p);
     return *p;
   };
   
   void loop();
 
+  // Uses broker instead of starting one once the network is up (host
+  // builds, benchmarks). Must be called before loop()
+  void attach(MqttBroker* broker);
+
+  // Publishes the changes of the properties since the last call (done by loop())
+  void syncProperties();
+
+  // Sleeps until MQTT traffic needs loop() or timeout_ms elapses. Keep the
+  // timeout short enough for ArduinoCloud.update() to be called regularly.
+  bool waitForEvent(uint32_t timeout_ms);
+
+  // Limits the publishes of each device (see MqttRateLimit)
+  void setRateLimit(const MqttRateLimit& limit) {
+    _rate_limit = limit;
+    if (_started) _mqtt_broker->setRateLimit(limit);
+  };
+
+  // Bytes each device may use in the broker (see MqttBroker::setClientBudget)
+  void setClientBudget(size_t bytes) {
+    _client_budget = bytes;
+    if (_started) _mqtt_broker->setClientBudget(bytes);
+  };
+
+  // Releases optional memory when the free heap falls below free_heap bytes
+  void setMemoryPressure(size_t free_heap) {
+    _memory_pressure = free_heap;
+    if (_started) _mqtt_broker->setMemoryPressure(free_heap);
+  };
+
+  // Publishes broker statistics under $SYS/broker/ every period_ms
+  void publishSysStats(uint32_t period_ms) {
+    _sys_period = period_ms;
+    if (_started) _mqtt_broker->publishSysStats(period_ms);
+  };
+
   static void onMsg(const TinyMqttClient* client, const Topic& topic, const char* payload, size_t len);
+  // Messages received during one broker loop, only the last one of each topic is used
+  static void onBatch(const TinyMqttClient* client, const TinyMqttClient::Delivery* deliveries, size_t count);
 
   private:
+  friend class BoolProperty;
+  void syncToMQTT(Property* p);
+
   bool _started = false;
   uint16_t _port = 1883;
   const char* _hostname = "arduino-broker";
   MqttBroker* _mqtt_broker;
+  MqttRateLimit _rate_limit;
+  uint32_t _sys_period = 0;
+  size_t _client_budget = 0;
+  size_t _memory_pressure = 0;
   TinyMqttClient* _mqtt_client;
-  std::vector<Property*> _properties;
+  std::vector<Property*, MqttAllocator<Property*, MqttMemory::Gateway>> _properties;
+  std::vector<Property*, MqttAllocator<Property*, MqttMemory::Gateway>> _polled;  // all but bools
+  // Bool properties are compared 32 at a time with their last seen values
+  std::vector<BoolProperty*, MqttAllocator<BoolProperty*, MqttMemory::Gateway>> _bools;
+  BoolBits _bool_seen;  // bit i: last seen value of _bools[i]
+  std::vector<bool, MqttAllocator<bool, MqttMemory::Gateway>> _latest;  // see onBatch()
 };
 
 } // namespace AMG
@@ -0,0 +1,90 @@
+// vim: ts=2 sw=2 expandtab
+#ifdef TINY_MQTT_EPOLL
+#include "TinyMqtt.h"
+#include "FanoutExecutor.h"
+
+MqttFanoutExecutor::MqttFanoutExecutor(size_t threads, size_t chunk_size)
+  : next_chunk(0), chunks_done(0), chunk_size(chunk_size ? chunk_size : 1)
+{
+  if (threads == 0)
+  {
+    threads = std::thread::hardware_concurrency();
+    if (threads > 1) threads--;
+  }
+  for(size_t i=0; i<threads; i++)
+    workers.emplace_back(&MqttFanoutExecutor::worker, this);
+}
+
+MqttFanoutExecutor::~MqttFanoutExecutor()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_all();
+  for(auto& thread: workers) thread.join();
+}
+
+void MqttFanoutExecutor::run(MqttClient* const* targets, size_t n, const char* data, size_t length)
+{
+  if (n == 0) return;
+  Job current = { targets, n, data, length, (n + chunk_size - 1) / chunk_size };
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = current;
+    next_chunk.store(0);
+    chunks_done.store(0);
+    generation++;
+  }
+  if (current.chunks > 1) wake.notify_all();
+
+  work(current);  // the caller takes its share
+
+  std::unique_lock<std::mutex> lock(mutex);
+  finished.wait(lock, [&]{ return chunks_done.load() == current.chunks and active == 0; });
+  job.chunks = 0;  // workers woken late find nothing to do
+}
+
+void MqttFanoutExecutor::work(const Job& current)
+{
+  size_t done = 0;
+  size_t chunk;
+  while((chunk = next_chunk.fetch_add(1)) < current.chunks)
+  {
+    size_t end = (chunk+1) * chunk_size;
+    if (end > current.count) end = current.count;
+    for(size_t i = chunk*chunk_size; i < end; i++)
+      current.clients[i]->write(current.buf, current.len);
+    done++;
+  }
+  if (done and chunks_done.fetch_add(done) + done == current.chunks)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished.notify_all();
+  }
+}
+
+void MqttFanoutExecutor::worker()
+{
+  uint32_t seen = 0;
+  while(true)
+  {
+    Job current;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&]{ return quit or generation != seen; });
+      if (quit) return;
+      seen = generation;
+      if (job.chunks == 0) continue;
+      current = job;
+      active++;
+    }
+    work(current);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active == 0) finished.notify_all();
+    }
+  }
+}
+
+#endif
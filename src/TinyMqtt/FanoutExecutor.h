@@ -0,0 +1,67 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#ifdef TINY_MQTT_EPOLL
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class MqttClient;
+
+/***
+ * Thread pool writing one encoded packet to many clients (TINY_MQTT_EPOLL).
+ *
+ * The subscribers are split in chunks that the workers, and the publishing
+ * thread itself, claim one at a time until none is left, so a slow socket
+ * only delays its own chunk. Every worker writes the same buffer.
+ *
+ * See MqttBroker::setFanoutExecutor().
+ */
+class MqttFanoutExecutor
+{
+  public:
+    /** threads=0 starts one worker per hardware thread, minus the caller */
+    MqttFanoutExecutor(size_t threads = 0, size_t chunk_size = 64);
+    ~MqttFanoutExecutor();
+
+    /** Writes buf to every client, returns when all writes are done */
+    void run(MqttClient* const* clients, size_t count, const char* buf, size_t len);
+
+    size_t threads() const { return workers.size(); }
+
+  private:
+    struct Job
+    {
+      MqttClient* const* clients;
+      size_t count;
+      const char* buf;
+      size_t len;
+      size_t chunks;    // 0: nothing to do
+    };
+
+    void worker();
+    void work(const Job&);
+
+    // Current job, copied by each worker under the mutex. A worker that
+    // copied it is active until it leaves work(), and run() returns only
+    // when no worker is active: the chunk counters and the buffer are
+    // never shared by two jobs.
+    Job job = {};
+    std::atomic<size_t> next_chunk;
+    std::atomic<size_t> chunks_done;
+    size_t active = 0;
+
+    size_t chunk_size;
+    uint32_t generation = 0;
+    bool quit = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::vector<std::thread> workers;
+};
+
+#endif
@@ -0,0 +1,5 @@
+// vim: ts=2 sw=2 expandtab
+#include "FlightRecorder.h"
+
+TINY_MQTT_THREAD_LOCAL MqttFlightRecorder::Record MqttFlightRecorder::ring[MqttFlightRecorder::Capacity];
+TINY_MQTT_THREAD_LOCAL size_t MqttFlightRecorder::next = 0;
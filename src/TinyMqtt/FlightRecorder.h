@@ -0,0 +1,98 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <Arduino.h>
+#include "TinyMqttConfig.h"
+#include "StringIndexer.h"   // TINY_MQTT_THREAD_LOCAL
+
+/***
+ * Always-on record of the last MqttConfig::FlightRecords packets received
+ * or sent, to diagnose an incident after the fact. A record is 32 bytes
+ * copied in a ring, without allocation.
+ *
+ * Clients are identified by their slot, a small number given when they are
+ * added to the broker (reused after they leave), and topics by their
+ * StringIndexer index when known (0 otherwise). Only the type and length
+ * of CONNECT packets are kept: they carry the credentials.
+ *
+ * MqttFlightRecorder::dump(Serial) prints the records, oldest first;
+ * MqttBroker::publishFlightRecorder() publishes them, binary, on
+ * $SYS/broker/flight (also triggered by publishing on $SYS/broker/flight/dump
+ * when MqttBroker::dumpFlightOnRequest() is enabled).
+ */
+class MqttFlightRecorder
+{
+  public:
+    enum __attribute__((packed)) Flags
+    {
+      Received = 0,
+      Sent = 1,
+      Dropped = 2   // publish refused by the rate limit
+    };
+
+    static const size_t PrefixLength = 21;
+
+    struct Record
+    {
+      uint32_t ms;        // millis()
+      uint16_t length;    // length of the data the prefix comes from
+      uint8_t slot;       // client slot
+      uint8_t header;     // first byte of the packet (type and flags)
+      uint8_t topic;      // topic index, 0 if unknown
+      uint8_t flags;
+      uint8_t prefix_length;
+      char prefix[PrefixLength];  // payload of a publish, else variable header (none for CONNECT)
+    };
+
+    static void record(uint8_t flags, uint8_t slot, uint8_t header, uint8_t topic, const char* data, size_t len)
+    {
+      if (MqttConfig::FlightRecords == 0) return;
+      Record& r = ring[next++ % Capacity];
+      r.ms = millis();
+      r.length = len > 0xFFFF ? 0xFFFF : static_cast<uint16_t>(len);
+      r.slot = slot;
+      r.header = header;
+      r.topic = topic;
+      r.flags = flags;
+      if ((header & 0xF0) == 0x10)  // CONNECT: user name and password
+        r.prefix_length = 0;
+      else
+        r.prefix_length = len > PrefixLength ? PrefixLength : static_cast<uint8_t>(len);
+      memcpy(r.prefix, data, r.prefix_length);
+    }
+
+    static size_t size() { return next < Capacity ? next : Capacity; }
+
+    /** i-th record, oldest first */
+    static const Record& at(size_t i) { return ring[(next - size() + i) % Capacity]; }
+
+    static void clear() { next = 0; }
+
+    /** Prints one line per record, oldest first */
+    template<class Output>
+    static void dump(Output& out)
+    {
+      char line[96];
+      for(size_t i = 0; i < size(); i++)
+      {
+        const Record& r = at(i);
+        int len = snprintf(line, sizeof(line), "%10u %s #%-3u %02X t%-3u %5u ",
+          static_cast<unsigned>(r.ms), r.flags & Sent ? "->" : r.flags & Dropped ? "xx" : "<-",
+          r.slot, r.header, r.topic, r.length);
+        for(uint8_t c = 0; c < r.prefix_length and len < static_cast<int>(sizeof(line)) - 1; c++)
+          line[len++] = (r.prefix[c] >= 32 and r.prefix[c] < 127) ? r.prefix[c] : '.';
+        line[len] = 0;
+        out.println(line);
+      }
+    }
+
+  private:
+    static const size_t Capacity = MqttConfig::FlightRecords ? MqttConfig::FlightRecords : 1;
+    static TINY_MQTT_THREAD_LOCAL Record ring[Capacity];
+    static TINY_MQTT_THREAD_LOCAL size_t next;
+};
+
+static_assert(sizeof(MqttFlightRecorder::Record) == 32, "Record must stay compact");
@@ -0,0 +1,42 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttAllocations.h"
+
+TINY_MQTT_THREAD_LOCAL uint32_t MqttAllocations::allocations = 0;
+TINY_MQTT_THREAD_LOCAL uint64_t MqttAllocations::allocated = 0;
+
+#ifdef TINY_MQTT_TRACK_ALLOCATIONS
+#include <stdlib.h>
+#include <new>
+
+// Replaces the global allocation functions of the program (host only)
+static void* trackedNew(size_t bytes)
+{
+  MqttAllocations::add(bytes);
+  void* p = malloc(bytes ? bytes : 1);
+  if (p == nullptr)
+  {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+    throw std::bad_alloc();
+#else
+    abort();
+#endif
+  }
+  return p;
+}
+
+void* operator new(size_t bytes) { return trackedNew(bytes); }
+void* operator new[](size_t bytes) { return trackedNew(bytes); }
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept
+{
+  MqttAllocations::add(bytes);
+  return malloc(bytes ? bytes : 1);
+}
+void* operator new[](size_t bytes, const std::nothrow_t& nt) noexcept { return operator new(bytes, nt); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+#endif
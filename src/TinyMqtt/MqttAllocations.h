@@ -0,0 +1,68 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "StringIndexer.h"   // TINY_MQTT_THREAD_LOCAL
+
+/***
+ * Allocation counter of host builds, enabled with -DTINY_MQTT_TRACK_ALLOCATIONS:
+ * the global operator new and MqttMemory::allocate() then count the
+ * allocations of the calling thread. Without it, counters stay at zero.
+ *
+ * Once warmed up, a steady state cycle (receive a publish, fan it out,
+ * update the gateway properties and publish their commands) must not
+ * allocate: buffers keep their capacity and topics stay interned.
+ *
+ *   MqttAllocationScope scope;
+ *   broker.loop();
+ *   scope.expectNone(Serial, "broker.loop()");  // prints the allocations if any
+ */
+class MqttAllocations
+{
+  public:
+    static void add(size_t bytes) { allocations++; allocated += bytes; }
+
+    static uint32_t count() { return allocations; }
+    static uint64_t bytes() { return allocated; }
+
+    static bool enabled()
+    {
+#ifdef TINY_MQTT_TRACK_ALLOCATIONS
+      return true;
+#else
+      return false;
+#endif
+    }
+
+  private:
+    static TINY_MQTT_THREAD_LOCAL uint32_t allocations;
+    static TINY_MQTT_THREAD_LOCAL uint64_t allocated;
+};
+
+/** Allocations of the current thread since the scope was created */
+class MqttAllocationScope
+{
+  public:
+    MqttAllocationScope() : start_count(MqttAllocations::count()), start_bytes(MqttAllocations::bytes()) {}
+
+    uint32_t allocations() const { return MqttAllocations::count() - start_count; }
+    uint64_t bytes() const { return MqttAllocations::bytes() - start_bytes; }
+
+    /** Returns true if the scope did not allocate, else prints what allocated */
+    template<class Output>
+    bool expectNone(Output& out, const char* what) const
+    {
+      uint32_t n = allocations();
+      if (n == 0) return true;
+      out.print(what);
+      out.print(" allocated ");
+      out.print(n);
+      out.print(" times, bytes=");
+      out.println(static_cast<unsigned long>(bytes()));
+      return false;
+    }
+
+  private:
+    uint32_t start_count;
+    uint64_t start_bytes;
+};
@@ -1,12 +1,28 @@
-// MqttReceiver must implement onPublish(...)
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include "TinyMqtt.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+/***
+ * Routes the publishes received by clients to member functions of
+ * receiver objects, which unregister themselves when destroyed.
+ * MqttReceiver derives from MqttClassBinder<MqttReceiver> and implements
+ * onPublish(...).
+ *
+ * Routes live in one flat table grouped by bucket, the bucket being a hash
+ * of the client: a publish indexes the bucket of its client and only walks
+ * the routes of that bucket, usually the routes of that client only.
+ * Routes without filter hold no Topic, so they take no StringIndexer slot.
+ */
 template <class MqttReceiver>
 class MqttClassBinder
 {
   public:
-    MqttClassBinder()
-    {
-      unregister(this);
-    }
+    using Handler = void (MqttReceiver::*)(const MqttClient*, const Topic&, const char*, size_t);
+
+    MqttClassBinder() {}
     ~MqttClassBinder() { unregister(this); }
 
     static void onUnpublished(MqttClient::CallBack handler)
@@ -14,9 +30,19 @@ class MqttClassBinder
       unrouted_handler = handler;
     }
 
+    // Every publish received by client is given to dest->onPublish()
     static void onPublish(MqttClient* client, MqttReceiver* dest)
     {
-      routes.insert(std::pair<MqttClient*, MqttReceiver*>(client, dest));
+      insert(Route{client, dest, nullptr, &dispatch<&MqttReceiver::onPublish>});
+      client->setCallback(onRoutePublish);
+    }
+
+    // Publishes received by client on topics matching filter are given to
+    // dest->*handler, as in onTopic<&Receiver::onTemperature>(client, "+/temp", this)
+    template<Handler handler>
+    static void onTopic(MqttClient* client, const Topic& filter, MqttReceiver* dest)
+    {
+      insert(Route{client, dest, std::unique_ptr<Topic>(new Topic(filter)), &dispatch<handler>});
       client->setCallback(onRoutePublish);
     }
 
@@ -25,21 +51,114 @@ class MqttClassBinder
       static_cast<MqttReceiver*>(this)->MqttReceiver::onPublish(client, topic, payload, length);
     }
 
-    static size_t size() { return routes.size(); }
+    static size_t size() { return routes.size() + pending.size(); }
 
-    static void reset() { routes.clear(); }
+    static void reset()
+    {
+      for(auto& route: routes)
+        if (route.dest) route.dest->route_count = 0;
+      for(auto& route: pending) route.dest->route_count = 0;
+      pending.clear();
+      if (dispatching)
+      {
+        for(auto& route: routes) route.dest = nullptr;  // removed after the dispatch
+        removed = true;
+      }
+      else
+      {
+        routes.clear();
+        reindex();
+      }
+    }
 
   private:
+    using Dispatch = void (*)(MqttClassBinder*, const MqttClient*, const Topic&, const char*, size_t);
+
+    static const size_t Buckets = 64;
+
+    struct Route
+    {
+      const MqttClient* client;
+      MqttClassBinder* dest;          // nullptr: unregistered during a dispatch
+      std::unique_ptr<Topic> filter;  // nullptr: any topic
+      Dispatch dispatch;
+    };
+
+    static size_t bucket(const MqttClient* client)
+    {
+      uintptr_t p = reinterpret_cast<uintptr_t>(client);
+      return (p ^ (p >> 6) ^ (p >> 12)) % Buckets;
+    }
+
+    // The member handler is a template argument, so the call is direct
+    template<Handler handler>
+    static void dispatch(MqttClassBinder* dest, const MqttClient* client, const Topic& topic, const char* payload, size_t length)
+    {
+      (static_cast<MqttReceiver*>(dest)->*handler)(client, topic, payload, length);
+    }
+
+    static void insert(Route&& route)
+    {
+      route.dest->route_count++;
+      // A handler may add routes: routes must not move during a dispatch
+      if (dispatching)
+      {
+        pending.push_back(std::move(route));
+        return;
+      }
+      add(std::move(route));
+      reindex();
+    }
+
+    // At the end of the routes of its bucket, so routes keep their order
+    static void add(Route&& route)
+    {
+      size_t b = bucket(route.client);
+      auto at = std::find_if(routes.begin(), routes.end(),
+        [b](const Route& other) { return bucket(other.client) > b; });
+      routes.insert(at, std::move(route));
+    }
+
+    static void reindex()
+    {
+      size_t i = 0;
+      for(size_t b = 0; b < Buckets; b++)
+      {
+        first[b] = static_cast<uint16_t>(i);
+        while(i < routes.size() and bucket(routes[i].client) == b) i++;
+      }
+      first[Buckets] = static_cast<uint16_t>(i);
+    }
+
+    // Applies the changes made by the handlers during a dispatch
+    static void applyPending()
+    {
+      routes.erase(std::remove_if(routes.begin(), routes.end(),
+        [](const Route& route) { return route.dest == nullptr; }), routes.end());
+      for(auto& route: pending) add(std::move(route));
+      pending.clear();
+      reindex();
+    }
 
     static void onRoutePublish(const MqttClient* client, const Topic& topic, const char* payload, size_t length)
     {
       bool unrouted = true;
-      auto receivers = routes.equal_range(client);
-      for(auto it = receivers.first; it != receivers.second; ++it)
+      size_t b = bucket(client);
+      size_t end = first[b + 1];
+      dispatching++;
+      for(size_t i = first[b]; i < end; i++)
       {
-        it->second->onPublish(client, topic, payload, length);
+        const Route& route = routes[i];
+        if (route.client != client or route.dest == nullptr) continue;
+        if (route.filter and not route.filter->matches(topic)) continue;
+        route.dispatch(route.dest, client, topic, payload, length);
         unrouted = false;
       }
+      if (--dispatching == 0 and (pending.size() or removed))
+      {
+        removed = false;
+        applyPending();
+      }
 
       if (unrouted and unrouted_handler)
       {
@@ -48,25 +167,52 @@ class MqttClassBinder
     }
 
   private:
-    void unregister(MqttClassBinder<MqttReceiver>* which)
+    static void unregister(MqttClassBinder<MqttReceiver>* which)
     {
-      if (routes.size()==0) return;   // bug in map stl
-      for(auto it=routes.begin(); it!=routes.end(); it++)
-        if (it->second == which)
-        {
-          routes.erase(it);
-          return;
-        }
+      if (which->route_count == 0) return;
+      pending.erase(std::remove_if(pending.begin(), pending.end(),
+        [which](const Route& route) { return route.dest == which; }), pending.end());
+      if (dispatching)
+      {
+        // The dispatch loop skips them, they are removed after it
+        for(auto& route: routes)
+          if (route.dest == which) route.dest = nullptr;
+        removed = true;
+      }
+      else
+      {
+        routes.erase(std::remove_if(routes.begin(), routes.end(),
+          [which](const Route& route) { return route.dest == which; }), routes.end());
+        reindex();
+      }
+      which->route_count = 0;
     }
 
-  static std::multimap<const MqttClient*, MqttClassBinder<MqttReceiver>*> routes;
+  uint16_t route_count = 0;
+
+  static std::vector<Route> routes;    // grouped by bucket
+  static uint16_t first[Buckets + 1];  // routes of bucket b: [first[b], first[b+1])
+  static std::vector<Route> pending;   // added during a dispatch
+  static uint16_t dispatching;         // nested dispatches in progress
+  static bool removed;                 // routes unregistered during a dispatch
   static MqttClient::CallBack unrouted_handler;
 
 };
 
 template<class MqttReceiver>
-std::multimap<const MqttClient*, MqttClassBinder<MqttReceiver>*> MqttClassBinder<MqttReceiver>::routes;
+std::vector<typename MqttClassBinder<MqttReceiver>::Route> MqttClassBinder<MqttReceiver>::routes;
 
 template<class MqttReceiver>
-MqttClient::CallBack MqttClassBinder<MqttReceiver>::unrouted_handler = nullptr;
+uint16_t MqttClassBinder<MqttReceiver>::first[MqttClassBinder<MqttReceiver>::Buckets + 1];
+
+template<class MqttReceiver>
+std::vector<typename MqttClassBinder<MqttReceiver>::Route> MqttClassBinder<MqttReceiver>::pending;
 
+template<class MqttReceiver>
+uint16_t MqttClassBinder<MqttReceiver>::dispatching = 0;
+
+template<class MqttReceiver>
+bool MqttClassBinder<MqttReceiver>::removed = false;
+
+template<class MqttReceiver>
+MqttClient::CallBack MqttClassBinder<MqttReceiver>::unrouted_handler = nullptr;
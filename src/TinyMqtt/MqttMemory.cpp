@@ -0,0 +1,102 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttMemory.h"
+#include "MqttAllocations.h"
+#include <stdlib.h>
+#include <new>
+#ifdef ESP32
+  #include <esp_heap_caps.h>
+#endif
+
+MqttMemoryResource* MqttMemory::resources[MqttMemory::UseCount] = {};
+
+MqttMemoryResource* MqttMemory::heap()
+{
+  // Never destroyed: thread_local tables may be freed after static objects
+  static MqttMallocResource* malloc_resource = new MqttMallocResource;
+  return malloc_resource;
+}
+
+MqttMemoryResource* MqttMemory::get(Use use)
+{
+  return resources[use] ? resources[use] : heap();
+}
+
+void* MqttMemory::allocate(Use use, size_t bytes, size_t align)
+{
+#ifdef TINY_MQTT_TRACK_ALLOCATIONS
+  MqttAllocations::add(bytes);
+#endif
+  void* p = get(use)->allocate(bytes, align);
+  if (p == nullptr)
+  {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+    throw std::bad_alloc();
+#else
+    abort();
+#endif
+  }
+  return p;
+}
+
+void* MqttMallocResource::allocate(size_t bytes, size_t)
+{
+  return malloc(bytes ? bytes : 1);
+}
+
+void MqttMallocResource::deallocate(void* p, size_t, size_t)
+{
+  free(p);
+}
+
+#ifdef ESP32
+void* MqttCapsResource::allocate(size_t bytes, size_t)
+{
+  return heap_caps_malloc(bytes ? bytes : 1, caps);
+}
+
+void MqttCapsResource::deallocate(void* p, size_t, size_t)
+{
+  heap_caps_free(p);
+}
+#endif
+
+MqttCountingResource::MqttCountingResource(MqttMemoryResource* upstream, size_t cap)
+  : upstream(upstream ? upstream : MqttMemory::heap()),
+    limit(cap), in_use(0), max_in_use(0), count(0), failed(0), refused(0), overrun(0)
+{
+}
+
+bool MqttCountingResource::admits(size_t bytes)
+{
+  if (limit == 0 or in_use + bytes <= limit) return true;
+  refused++;
+  return false;
+}
+
+void* MqttCountingResource::allocate(size_t bytes, size_t align)
+{
+  size_t used = in_use += bytes;
+  if (limit and used > limit) overrun++;  // not refusable, see admits()
+  void* p = upstream->allocate(bytes, align);
+  if (p == nullptr)
+  {
+    in_use -= bytes;
+    failed++;
+    return nullptr;
+  }
+  count++;
+#ifdef TINY_MQTT_EPOLL
+  size_t peak = max_in_use;
+  while(used > peak and not max_in_use.compare_exchange_weak(peak, used));
+#else
+  if (used > max_in_use) max_in_use = used;
+#endif
+  return p;
+}
+
+void MqttCountingResource::deallocate(void* p, size_t bytes, size_t align)
+{
+  if (p == nullptr) return;
+  in_use -= bytes;
+  upstream->deallocate(p, bytes, align);
+}
@@ -0,0 +1,158 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#ifdef TINY_MQTT_EPOLL
+  #include <atomic>
+#endif
+
+/***
+ * Memory resources used by TinyMqtt and the gateway.
+ *
+ * Each subsystem allocates from its own slot, so that it can be placed in a
+ * given memory (PSRAM on ESP32), capped, or measured on its own:
+ *
+ *   static MqttCountingResource topics(nullptr, 8192);  // 8k max
+ *   MqttMemory::set(MqttMemory::Topics, &topics);
+ *
+ * Resources must be set at startup, before the objects they serve are
+ * created, and must outlive them. Slots without resource use malloc().
+ *
+ * A cap is enforced where growth can be refused (MqttMemory::fits()): new
+ * connections, subscriptions and receive buffers. The standard containers
+ * cannot handle a failed allocation, so the other allocations exceed the
+ * cap rather than fail, and are counted (MqttCountingResource::overruns()).
+ */
+class MqttMemoryResource
+{
+  public:
+    virtual ~MqttMemoryResource() {}
+    // Returns nullptr when out of memory
+    virtual void* allocate(size_t bytes, size_t align) = 0;
+    virtual void deallocate(void* p, size_t bytes, size_t align) = 0;
+    // Whether bytes more can be allocated, counts a refusal if not
+    virtual bool admits(size_t) { return true; }
+};
+
+class MqttMemory
+{
+  public:
+    enum __attribute__((packed)) Use
+    {
+      Broker,    // MqttBroker and its list of clients
+      Clients,   // MqttClient and its subscriptions
+      Topics,    // StringIndexer
+      Messages,  // MqttMessage buffers
+      Gateway,   // Gateway properties
+      UseCount
+    };
+
+    static void set(Use use, MqttMemoryResource* resource) { resources[use] = resource; }
+    static MqttMemoryResource* get(Use use);
+    static MqttMemoryResource* heap();  // malloc()
+
+    /** To be checked before a growth that the caller can refuse */
+    static bool fits(Use use, size_t bytes) { return get(use)->admits(bytes); }
+
+    /** Never returns nullptr: when the memory itself is exhausted, throws
+        std::bad_alloc, or aborts when exceptions are disabled */
+    static void* allocate(Use use, size_t bytes, size_t align);
+    static void deallocate(Use use, void* p, size_t bytes, size_t align)
+    { get(use)->deallocate(p, bytes, align); }
+
+  private:
+    static MqttMemoryResource* resources[UseCount];
+};
+
+/** Stateless allocator of a subsystem, for the standard containers */
+template<class T, MqttMemory::Use use>
+struct MqttAllocator
+{
+  using value_type = T;
+  template<class U> struct rebind { using other = MqttAllocator<U, use>; };
+
+  MqttAllocator() {}
+  template<class U> MqttAllocator(const MqttAllocator<U, use>&) {}
+
+  T* allocate(size_t n)
+  { return static_cast<T*>(MqttMemory::allocate(use, n * sizeof(T), alignof(T))); }
+
+  void deallocate(T* p, size_t n) { MqttMemory::deallocate(use, p, n * sizeof(T), alignof(T)); }
+
+  template<class U> bool operator==(const MqttAllocator<U, use>&) const { return true; }
+  template<class U> bool operator!=(const MqttAllocator<U, use>&) const { return false; }
+};
+
+template<MqttMemory::Use use>
+using MqttString = std::basic_string<char, std::char_traits<char>, MqttAllocator<char, use>>;
+
+/** Class level new/delete allocating objects in a subsystem */
+#define TINY_MQTT_ALLOCATED_IN(use) \
+  static void* operator new(size_t bytes) { return MqttMemory::allocate(use, bytes, alignof(max_align_t)); } \
+  static void operator delete(void* p, size_t bytes) { MqttMemory::deallocate(use, p, bytes, alignof(max_align_t)); }
+
+/** malloc() / free() */
+class MqttMallocResource : public MqttMemoryResource
+{
+  public:
+    void* allocate(size_t bytes, size_t align) override;
+    void deallocate(void* p, size_t bytes, size_t align) override;
+};
+
+#ifdef ESP32
+/** heap_caps_malloc(), for instance MqttCapsResource(MALLOC_CAP_SPIRAM) */
+class MqttCapsResource : public MqttMemoryResource
+{
+  public:
+    MqttCapsResource(uint32_t caps) : caps(caps) {}
+    void* allocate(size_t bytes, size_t align) override;
+    void deallocate(void* p, size_t bytes, size_t align) override;
+
+  private:
+    uint32_t caps;
+};
+#endif
+
+/***
+ * Counts the memory allocated from upstream (malloc if null), with an
+ * optional cap in bytes (0 for no limit): admits() refuses what would
+ * exceed it, and allocations made anyway are counted as overruns.
+ */
+class MqttCountingResource : public MqttMemoryResource
+{
+  public:
+    MqttCountingResource(MqttMemoryResource* upstream = nullptr, size_t cap = 0);
+
+    void* allocate(size_t bytes, size_t align) override;
+    void deallocate(void* p, size_t bytes, size_t align) override;
+    bool admits(size_t bytes) override;
+
+    size_t inUse() const { return in_use; }
+    size_t peak() const { return max_in_use; }
+    size_t cap() const { return limit; }
+    uint32_t allocations() const { return count; }
+    uint32_t failures() const { return failed; }     // upstream out of memory
+    uint32_t refusals() const { return refused; }    // growths refused by admits()
+    uint32_t overruns() const { return overrun; }    // allocations over the cap
+
+  private:
+    MqttMemoryResource* upstream;
+    size_t limit;
+#ifdef TINY_MQTT_EPOLL
+    // Shared by the brokers of an MqttReactorGroup
+    std::atomic<size_t> in_use;
+    std::atomic<size_t> max_in_use;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> failed;
+    std::atomic<uint32_t> refused;
+    std::atomic<uint32_t> overrun;
+#else
+    size_t in_use;
+    size_t max_in_use;
+    uint32_t count;
+    uint32_t failed;
+    uint32_t refused;
+    uint32_t overrun;
+#endif
+};
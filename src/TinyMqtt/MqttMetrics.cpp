@@ -0,0 +1,65 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttMetrics.h"
+
+MqttMetrics::Value MqttMetrics::packets_in[MqttMetrics::PacketTypes];
+MqttMetrics::Value MqttMetrics::packets_out[MqttMetrics::PacketTypes];
+MqttMetrics::Value MqttMetrics::counters[MqttMetrics::CounterCount];
+MqttMetrics::Level MqttMetrics::gauges[MqttMetrics::GaugeCount];
+MqttMetrics::Value MqttMetrics::histograms[MqttMetrics::HistogramCount][MqttMetrics::Buckets];
+
+void MqttMetrics::snapshot(Snapshot& snap)
+{
+  for(size_t i=0; i<PacketTypes; i++)
+  {
+    snap.packets_in[i] = packets_in[i];
+    snap.packets_out[i] = packets_out[i];
+  }
+  for(size_t i=0; i<CounterCount; i++) snap.counters[i] = counters[i];
+  for(size_t i=0; i<GaugeCount; i++) snap.gauges[i] = gauges[i];
+  for(size_t h=0; h<HistogramCount; h++)
+    for(size_t b=0; b<Buckets; b++)
+      snap.histograms[h][b] = histograms[h][b];
+}
+
+void MqttMetrics::reset()
+{
+  for(size_t i=0; i<PacketTypes; i++)
+  {
+    packets_in[i] = 0;
+    packets_out[i] = 0;
+  }
+  for(size_t i=0; i<CounterCount; i++) counters[i] = 0;
+  for(size_t h=0; h<HistogramCount; h++)
+    for(size_t b=0; b<Buckets; b++)
+      histograms[h][b] = 0;
+}
+
+const char* MqttMetrics::name(Counter counter)
+{
+  static const char* names[CounterCount] =
+    { "bytes_in", "bytes_out", "parse_errors", "protocol_errors", "clients_accepted", "clients_refused",
+      "slow_clients" };
+  return counter < CounterCount ? names[counter] : "?";
+}
+
+const char* MqttMetrics::name(Gauge which)
+{
+  static const char* names[GaugeCount] = { "clients", "out_queue_bytes" };
+  return which < GaugeCount ? names[which] : "?";
+}
+
+const char* MqttMetrics::name(Histogram histogram)
+{
+  static const char* names[HistogramCount] = { "fanout_width", "publish_bytes", "batch_size", "loop_us" };
+  return histogram < HistogramCount ? names[histogram] : "?";
+}
+
+const char* MqttMetrics::packetName(size_t type)
+{
+  static const char* names[PacketTypes] =
+  {
+    "reserved", "connect", "connack", "publish", "puback", "pubrec", "pubrel", "pubcomp",
+    "subscribe", "suback", "unsubscribe", "unsuback", "pingreq", "pingresp", "disconnect", "auth"
+  };
+  return type < PacketTypes ? names[type] : "?";
+}
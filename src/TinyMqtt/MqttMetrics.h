@@ -0,0 +1,107 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "TinyMqttConfig.h"
+#ifdef TINY_MQTT_EPOLL
+  #include <atomic>
+#endif
+
+/***
+ * Process wide metrics of TinyMqtt, in fixed slots: updating one is a
+ * single increment, without lookup nor allocation. They are shared by all
+ * the brokers (and reactor threads), and compiled out when
+ * MqttConfig::Metrics is false.
+ *
+ * Histograms have log2 buckets: bucket 0 counts the zeros, bucket i counts
+ * the values in [2^(i-1), 2^i).
+ *
+ *   MqttMetrics::Snapshot snap;
+ *   MqttMetrics::snapshot(snap);
+ *   Serial << MqttMetrics::name(MqttMetrics::BytesIn) << '=' << snap.counters[MqttMetrics::BytesIn];
+ */
+class MqttMetrics
+{
+  public:
+    enum __attribute__((packed)) Counter
+    {
+      BytesIn,
+      BytesOut,
+      ParseErrors,      // invalid length or packet too long
+      ProtocolErrors,   // packet closing the connection
+      ClientsAccepted,
+      ClientsRefused,   // see MqttConfig::MaxClients
+      SlowClients,      // closed because their output backlog was full (see MqttConfig::MaxOutQueue, TcpEpoll.h)
+      CounterCount
+    };
+
+    enum __attribute__((packed)) Gauge
+    {
+      Clients,
+      OutQueueBytes,    // bytes waiting for AsyncTCP
+      GaugeCount
+    };
+
+    enum __attribute__((packed)) Histogram
+    {
+      FanoutWidth,      // subscribers reached by a publish
+      PublishBytes,     // size of received publishes
+      BatchSize,        // messages given at once to a batch callback
+      LoopMicros,       // duration of MqttBroker::loop()
+      HistogramCount
+    };
+
+    static const size_t Buckets = 33;
+    static const size_t PacketTypes = 16;  // indexed by type >> 4
+
+    struct Snapshot
+    {
+      uint32_t packets_in[PacketTypes];
+      uint32_t packets_out[PacketTypes];
+      uint32_t counters[CounterCount];
+      int32_t gauges[GaugeCount];
+      uint32_t histograms[HistogramCount][Buckets];
+    };
+
+    static void count(Counter counter, uint32_t n = 1)
+    { if (MqttConfig::Metrics) add(counters[counter], n); }
+
+    static void packetIn(uint8_t header, uint32_t n = 1)
+    { if (MqttConfig::Metrics) add(packets_in[header >> 4], n); }
+
+    static void packetOut(uint8_t header, uint32_t n = 1)
+    { if (MqttConfig::Metrics) add(packets_out[header >> 4], n); }
+
+    static void gauge(Gauge which, int32_t delta)
+    { if (MqttConfig::Metrics) add(gauges[which], delta); }
+
+    static void record(Histogram histogram, uint32_t value)
+    { if (MqttConfig::Metrics) add(histograms[histogram][bucket(value)], 1); }
+
+    static size_t bucket(uint32_t value) { return value ? 32 - __builtin_clz(value) : 0; }
+
+    static void snapshot(Snapshot&);
+    static void reset();  // gauges are kept
+
+    static const char* name(Counter);
+    static const char* name(Gauge);
+    static const char* name(Histogram);
+    static const char* packetName(size_t type);  // type >> 4
+
+  private:
+#ifdef TINY_MQTT_EPOLL
+    using Value = std::atomic<uint32_t>;
+    using Level = std::atomic<int32_t>;
+    template<class T, class N> static void add(std::atomic<T>& v, N n) { v.fetch_add(n, std::memory_order_relaxed); }
+#else
+    using Value = uint32_t;
+    using Level = int32_t;
+    template<class T, class N> static void add(T& v, N n) { v += n; }
+#endif
+
+    static Value packets_in[PacketTypes];
+    static Value packets_out[PacketTypes];
+    static Value counters[CounterCount];
+    static Level gauges[GaugeCount];
+    static Value histograms[HistogramCount][Buckets];
+};
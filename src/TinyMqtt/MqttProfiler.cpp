@@ -0,0 +1,90 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttProfiler.h"
+#include <stdio.h>
+#include <string.h>
+#if defined(ESP32) || defined(ESP8266)
+  #include <Arduino.h>
+#elif defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #include <chrono>
+  #include <thread>
+#else
+  #include <chrono>
+#endif
+
+TINY_MQTT_THREAD_LOCAL MqttProfiler::Stats MqttProfiler::stats[MqttProfiler::PhaseCount];
+
+MqttProfiler::Ticks MqttProfiler::ticks()
+{
+#if defined(ESP32) || defined(ESP8266)
+  return ESP.getCycleCount();
+#elif defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint32_t MqttProfiler::ticksPerMicro()
+{
+#if defined(ESP32) || defined(ESP8266)
+  return ESP.getCpuFreqMHz();
+#elif defined(__x86_64__) || defined(__i386__)
+  // The TSC frequency is measured once, against steady_clock
+  static uint32_t per_micro = []
+  {
+    using namespace std::chrono;
+    auto t0 = steady_clock::now();
+    Ticks c0 = ticks();
+    std::this_thread::sleep_for(milliseconds(10));
+    Ticks c1 = ticks();
+    auto us = duration_cast<microseconds>(steady_clock::now() - t0).count();
+    uint32_t tpm = us ? static_cast<uint32_t>((c1 - c0) / us) : 1;
+    return tpm ? tpm : 1;
+  }();
+  return per_micro;
+#else
+  return 1000;  // nanoseconds
+#endif
+}
+
+const char* MqttProfiler::name(Phase phase)
+{
+  static const char* names[PhaseCount] =
+  {
+    "broker_loop", "accept", "client_read", "process_message", "fanout",
+    "gateway_scan", "cloud_update", "user1", "user2", "user3"
+  };
+  return phase < PhaseCount ? names[phase] : "?";
+}
+
+void MqttProfiler::reset()
+{
+  memset(stats, 0, sizeof(stats));
+}
+
+int MqttProfiler::format(Phase phase, char* buf, size_t size)
+{
+  const Stats& s = stats[phase];
+  uint32_t tpm = ticksPerMicro();
+
+  // Upper bound of the bucket holding the 99th percentile
+  uint64_t p99 = 0;
+  uint64_t seen = 0;
+  for(size_t b = 0; b < Buckets and s.calls; b++)
+  {
+    seen += s.histogram[b];
+    if (seen * 100 >= static_cast<uint64_t>(s.calls) * 99)
+    {
+      p99 = b ? (1ull << b) - 1 : 0;
+      break;
+    }
+  }
+  if (p99 > s.max) p99 = s.max;
+  return snprintf(buf, size, "{\"calls\":%u,\"total_us\":%llu,\"max_us\":%u,\"p99_us\":%llu}",
+    static_cast<unsigned>(s.calls),
+    static_cast<unsigned long long>(s.total / tpm),
+    static_cast<unsigned>(s.max / tpm),
+    static_cast<unsigned long long>(p99 / tpm));
+}
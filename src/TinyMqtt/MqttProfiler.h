@@ -0,0 +1,120 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "StringIndexer.h"   // TINY_MQTT_THREAD_LOCAL
+
+#ifndef TINY_MQTT_PROFILE
+#define TINY_MQTT_PROFILE 0
+#endif
+
+/***
+ * Phase profiler, enabled with -DTINY_MQTT_PROFILE=1.
+ *
+ *   void loop()
+ *   {
+ *     { TM_PROFILE_SCOPE(MqttProfiler::CloudUpdate); ArduinoCloud.update(); }
+ *     ArduinoMQTTGateway.loop();
+ *   }
+ *
+ * A scope reads a cycle counter (CCOUNT on ESP, rdtsc on x86 hosts,
+ * steady_clock elsewhere) when it starts and ends, and accumulates the
+ * duration in its phase: calls, total, max and a log2 histogram. Times are
+ * inclusive: the time of Fanout is also counted in ProcessMessage, that is
+ * also counted in ClientRead...
+ *
+ * Without TINY_MQTT_PROFILE, scopes compile to nothing. On host builds each
+ * thread has its own statistics (see MqttReactor.h).
+ */
+class MqttProfiler
+{
+  public:
+    enum __attribute__((packed)) Phase
+    {
+      BrokerLoop,      // MqttBroker::loop()
+      Accept,          // new connections
+      ClientRead,      // reading and parsing a client
+      ProcessMessage,  // MqttClient::processMessage()
+      Fanout,          // MqttBroker::publish()
+      GatewayScan,     // change detection of the gateway properties
+      CloudUpdate,     // for ArduinoCloud.update() in the sketch
+      User1,
+      User2,
+      User3,
+      PhaseCount
+    };
+
+    static const size_t Buckets = 33;
+
+    struct Stats
+    {
+      uint32_t calls;
+      uint64_t total;     // ticks
+      uint32_t max;       // ticks
+      uint32_t histogram[Buckets];  // log2 of ticks
+    };
+
+#if defined(ESP32) || defined(ESP8266)
+    using Ticks = uint32_t;
+#else
+    using Ticks = uint64_t;
+#endif
+
+    static Ticks ticks();
+    static uint32_t ticksPerMicro();
+
+    static void add(Phase phase, Ticks duration)
+    {
+      Stats& s = stats[phase];
+      uint32_t d = duration > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(duration);
+      s.calls++;
+      s.total += d;
+      if (d > s.max) s.max = d;
+      s.histogram[d ? 32 - __builtin_clz(d) : 0]++;
+    }
+
+    static const Stats& get(Phase phase) { return stats[phase]; }
+    static const char* name(Phase);
+    static void reset();
+
+    /** Writes the stats of phase as JSON in buf, microseconds:
+        {"calls":12,"total_us":340,"max_us":80,"p99_us":63} */
+    static int format(Phase phase, char* buf, size_t size);
+
+    /** Writes one line per phase called at least once */
+    template<class Output>
+    static void dump(Output& out)
+    {
+      char buf[96];
+      for(int phase = 0; phase < PhaseCount; phase++)
+      {
+        if (stats[phase].calls == 0) continue;
+        format(static_cast<Phase>(phase), buf, sizeof(buf));
+        out.print(name(static_cast<Phase>(phase)));
+        out.print(' ');
+        out.println(buf);
+      }
+    }
+
+  private:
+    static TINY_MQTT_THREAD_LOCAL Stats stats[PhaseCount];
+};
+
+class MqttProfileScope
+{
+  public:
+    MqttProfileScope(MqttProfiler::Phase phase) : phase(phase), start(MqttProfiler::ticks()) {}
+    ~MqttProfileScope() { MqttProfiler::add(phase, MqttProfiler::ticks() - start); }
+
+  private:
+    MqttProfiler::Phase phase;
+    MqttProfiler::Ticks start;
+};
+
+#if TINY_MQTT_PROFILE
+  #define TM_PROFILE_CONCAT2(a, b) a##b
+  #define TM_PROFILE_CONCAT(a, b) TM_PROFILE_CONCAT2(a, b)
+  #define TM_PROFILE_SCOPE(phase) MqttProfileScope TM_PROFILE_CONCAT(tm_profile_, __LINE__)(phase)
+#else
+  #define TM_PROFILE_SCOPE(phase)
+#endif
@@ -0,0 +1,197 @@
+// vim: ts=2 sw=2 expandtab
+#ifdef TINY_MQTT_EPOLL
+#include "MqttReactor.h"
+
+// Maximum time spent in epoll_wait() when a reactor has nothing to do
+static const int IdleWaitMs = 100;
+
+MqttReactor::MqttReactor(MqttReactorGroup* group, size_t id, uint16_t port)
+  : group(group), id(id), port(port), broker(nullptr), inbox(nullptr), sleeping(false), clients_count(0),
+    relayed_count(0), interests(0), filters{}
+{
+  createBroker();
+}
+
+void MqttReactor::createBroker()
+{
+  broker = new MqttBroker(port);
+  broker->server->reusePort(true);
+  broker->setRelay(onRelay, this, onSubscribed);
+}
+
+MqttReactor::~MqttReactor()
+{
+  if (thread.joinable()) thread.join();
+  // Packets left in the inbox are simply dropped
+  Node* node = inbox.exchange(nullptr);
+  while(node)
+  {
+    Node* next = node->next;
+    delete node;
+    node = next;
+  }
+  delete broker;  // not started: nothing was interned by another thread
+}
+
+void MqttReactor::run()
+{
+  while(group->running())
+  {
+    broker->loop();
+    bool busy = processInbox();
+    clients_count.store(broker->clientsCount(), std::memory_order_relaxed);
+
+    // Sleep until a socket is ready or another reactor pushes a packet
+    sleeping.store(true);
+    if (not busy and inbox.load() == nullptr and broker->server->backlog() == 0)
+      broker->server->poll(IdleWaitMs);
+    sleeping.store(false);
+  }
+  // Topics are interned per thread, so clients must be destroyed by the
+  // thread that created them.
+  broker->removeAllClients();
+
+  // The broker too, once no other reactor can relay a packet to it and
+  // stop() is done waking the reactors up.
+  group->active--;
+  while(group->active.load() or not group->stopped.load())
+    std::this_thread::yield();
+  delete broker;
+  broker = nullptr;
+}
+
+void MqttReactor::push(const SharedPacket& packet)
+{
+  Node* node = new Node{packet, inbox.load(std::memory_order_relaxed)};
+  // seq_cst, as the stores and loads of run(): either this reactor sees
+  // sleeping or the sleeping one sees the packet before waiting
+  while(not inbox.compare_exchange_weak(node->next, node));
+  relayed_count.fetch_add(1, std::memory_order_relaxed);
+  if (sleeping.exchange(false)) wakeup();
+}
+
+void MqttReactor::wakeup()
+{
+  broker->server->wakeup();
+}
+
+bool MqttReactor::processInbox()
+{
+  Node* node = inbox.exchange(nullptr);
+  if (node == nullptr) return false;
+
+  // Restore the publish order
+  Node* ordered = nullptr;
+  while(node)
+  {
+    Node* next = node->next;
+    node->next = ordered;
+    ordered = node;
+    node = next;
+  }
+
+  while(ordered)
+  {
+    const Packet& packet = *ordered->packet;
+    MqttMessage msg;
+    msg.incoming(packet.bytes.data(), packet.bytes.size());
+    if (msg.type() == MqttMessage::Type::Publish)
+    {
+      Topic topic(packet.topic);
+      broker->publish(nullptr, topic, msg);  // null source: not relayed again
+    }
+    Node* next = ordered->next;
+    delete ordered;
+    ordered = next;
+  }
+  return true;
+}
+
+void MqttReactor::onRelay(void* reactor_ptr, const Topic& topic, const MqttMessage& msg)
+{
+  MqttReactor* reactor = static_cast<MqttReactor*>(reactor_ptr);
+  auto& reactors = reactor->group->reactors;
+  if (reactors.size() < 2) return;
+
+  uint64_t wanted = interest(topic.c_str()) | interest("+");
+  SharedPacket packet;
+  for(auto& other: reactors)
+  {
+    if (other.get() == reactor or (other->interests.load() & wanted) == 0) continue;
+    if (not packet)
+      packet = std::make_shared<Packet>(Packet{string(topic.c_str(), topic.str().length()), string(msg.begin(), msg.end()-msg.begin())});
+    other->push(packet);
+  }
+}
+
+uint64_t MqttReactor::interest(const char* topic)
+{
+  if ((topic[0] == '+' or topic[0] == '#') and (topic[1] == '/' or topic[1] == 0))
+    return uint64_t(1) << 63;
+  uint32_t hash = 2166136261u;  // FNV-1a
+  for(const char* c = topic; *c and *c != '/'; c++)
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+  return uint64_t(1) << (hash % 63);
+}
+
+// Called by the thread of the reactor, before the subscriber is acknowledged
+void MqttReactor::onSubscribed(void* reactor_ptr, const Topic& filter, bool added)
+{
+  MqttReactor* reactor = static_cast<MqttReactor*>(reactor_ptr);
+  uint64_t bit = interest(filter.c_str());
+  uint32_t& count = reactor->filters[__builtin_ctzll(bit)];
+  if (added)
+  {
+    if (count++ == 0) reactor->interests.fetch_or(bit);
+  }
+  else if (count and --count == 0)
+    reactor->interests.fetch_and(~bit);
+}
+
+MqttReactorGroup::MqttReactorGroup(uint16_t port, size_t count)
+  : run(false), active(0), stopped(false)
+{
+  if (count == 0) count = std::thread::hardware_concurrency();
+  if (count == 0) count = 1;
+  for(size_t i=0; i<count; i++)
+    reactors.emplace_back(new MqttReactor(this, i, port));
+}
+
+MqttReactorGroup::~MqttReactorGroup()
+{
+  stop();
+}
+
+void MqttReactorGroup::begin()
+{
+  if (run.exchange(true)) return;
+  active = reactors.size();
+  stopped = false;
+  // Sockets are created before any reactor can relay a packet to another
+  for(auto& reactor: reactors)
+  {
+    if (reactor->broker == nullptr) reactor->createBroker();  // stopped before
+    reactor->broker->begin();
+  }
+  for(auto& reactor: reactors)
+    reactor->thread = std::thread(&MqttReactor::run, reactor.get());
+}
+
+void MqttReactorGroup::stop()
+{
+  if (not run.exchange(false)) return;
+  for(auto& reactor: reactors)
+    reactor->wakeup();
+  stopped = true;
+  for(auto& reactor: reactors)
+    reactor->thread.join();
+}
+
+size_t MqttReactorGroup::clientsCount() const
+{
+  size_t count = 0;
+  for(auto& reactor: reactors) count += reactor->clientsCount();
+  return count;
+}
+
+#endif
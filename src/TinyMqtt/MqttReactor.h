@@ -0,0 +1,108 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#ifdef TINY_MQTT_EPOLL
+
+#include "TinyMqtt.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/***
+ * Multi-reactor broker for Linux host builds (TINY_MQTT_EPOLL).
+ *
+ * MqttReactorGroup runs one MqttBroker per thread. All brokers listen on
+ * the same port with SO_REUSEPORT, so the kernel spreads the connections
+ * among them and each reactor only handles its own partition.
+ *
+ * A publish received by a reactor is delivered to its own clients, then
+ * relayed to the other reactors that may want it: the encoded packet is
+ * copied once, and the same immutable buffer is pushed to the lock-free
+ * inbox of each of them.
+ *
+ * What a reactor wants is summed up by the first level of the filters of
+ * its clients, one bit per hash of that level (the last bit for the
+ * filters starting with a wildcard). A reactor whose bits do not match
+ * the first level of a topic surely has no subscriber for it; one with no
+ * subscription at all never gets a packet.
+ */
+class MqttReactorGroup;
+
+class MqttReactor
+{
+  public:
+    struct Packet
+    {
+      string topic;
+      string bytes;   // encoded publish, as received
+    };
+    using SharedPacket = std::shared_ptr<const Packet>;
+
+    ~MqttReactor();
+
+    size_t index() const { return id; }
+    size_t clientsCount() const { return clients_count.load(std::memory_order_relaxed); }
+    /** Publishes pushed to this reactor by the others */
+    size_t relayed() const { return relayed_count.load(std::memory_order_relaxed); }
+
+  private:
+    friend class MqttReactorGroup;
+
+    // Multiple producers / single consumer stack, reversed when drained
+    struct Node
+    {
+      SharedPacket packet;
+      Node* next;
+    };
+
+    MqttReactor(MqttReactorGroup* group, size_t id, uint16_t port);
+
+    void createBroker();
+    void run();
+    void push(const SharedPacket&);
+    void wakeup();
+    bool processInbox();
+    static void onRelay(void* reactor, const Topic& topic, const MqttMessage& msg);
+    static void onSubscribed(void* reactor, const Topic& filter, bool added);
+    // Bit of the first level of a topic or filter in interests
+    static uint64_t interest(const char* topic);
+
+    MqttReactorGroup* group;
+    size_t id;
+    uint16_t port;
+    MqttBroker* broker;   // destroyed by the reactor thread, see run()
+    std::thread thread;
+    std::atomic<Node*> inbox;
+    std::atomic<bool> sleeping;
+    std::atomic<size_t> clients_count;
+    std::atomic<size_t> relayed_count;
+    std::atomic<uint64_t> interests;  // read by the other reactors
+    uint32_t filters[64];             // filters per bit of interests
+};
+
+class MqttReactorGroup
+{
+  public:
+    /** reactors=0 starts one reactor per hardware thread */
+    MqttReactorGroup(uint16_t port, size_t reactors = 0);
+    ~MqttReactorGroup();
+
+    void begin();
+    void stop();
+
+    bool running() const { return run.load(); }
+    size_t size() const { return reactors.size(); }
+    size_t clientsCount() const;
+
+    const MqttReactor& operator[](size_t i) const { return *reactors[i]; }
+
+  private:
+    friend class MqttReactor;
+
+    std::vector<std::unique_ptr<MqttReactor>> reactors;
+    std::atomic<bool> run;
+    std::atomic<size_t> active;   // reactors still in their loop
+    std::atomic<bool> stopped;    // stop() has woken up all the reactors
+};
+
+#endif
@@ -0,0 +1,83 @@
+// vim: ts=2 sw=2 expandtab
+#include "MqttTrace.h"
+
+#ifdef TINY_MQTT_TRACE
+#include <chrono>
+
+MqttTrace::Event* MqttTrace::events = nullptr;
+size_t MqttTrace::capacity = 0;
+std::atomic<size_t> MqttTrace::next(0);
+std::atomic<uint32_t> MqttTrace::messages(0);
+uint64_t MqttTrace::origin = 0;
+volatile bool MqttTrace::recording = false;
+thread_local uint32_t MqttTrace::current_message = 0;
+
+static uint16_t threadNumber()
+{
+  static std::atomic<uint16_t> threads(0);
+  static thread_local uint16_t number = ++threads;
+  return number;
+}
+
+void MqttTrace::start(size_t events_capacity)
+{
+  recording = false;
+  delete[] events;
+  events = new Event[events_capacity];
+  capacity = events_capacity;
+  next = 0;
+  origin = now();
+  recording = true;
+}
+
+uint64_t MqttTrace::now()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void MqttTrace::add(const char* name, uint64_t start, uint64_t end)
+{
+  if (not recording) return;
+  size_t i = next.fetch_add(1, std::memory_order_relaxed);
+  if (i >= capacity) return;
+  Event& e = events[i];
+  e.name = name;
+  e.start = start - origin;
+  uint64_t duration = end - start;
+  e.duration = duration > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(duration);
+  e.message = current_message;
+  e.thread = threadNumber();
+}
+
+size_t MqttTrace::size()
+{
+  size_t n = next.load();
+  return n < capacity ? n : capacity;
+}
+
+void MqttTrace::write(FILE* out)
+{
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for(size_t i = 0; i < size(); i++)
+  {
+    const Event& e = events[i];
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"tinymqtt\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+      "\"ts\":%llu.%03u,\"dur\":%u.%03u",
+      i ? ",\n" : "", e.name, e.thread,
+      static_cast<unsigned long long>(e.start / 1000), static_cast<unsigned>(e.start % 1000),
+      e.duration / 1000, e.duration % 1000);
+    if (e.message) fprintf(out, ",\"args\":{\"msg\":%u}", e.message);
+    fputc('}', out);
+  }
+  fprintf(out, "\n]}\n");
+}
+
+bool MqttTrace::save(const char* path)
+{
+  FILE* out = fopen(path, "w");
+  if (out == nullptr) return false;
+  write(out);
+  return fclose(out) == 0;
+}
+#endif
@@ -0,0 +1,119 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/***
+ * Trace of the journey of each message on host builds, enabled with
+ * -DTINY_MQTT_TRACE:
+ *
+ *   MqttTrace::start(1000000);   // events kept, allocated once
+ *   ...                          // run the broker (and the gateway)
+ *   MqttTrace::save("tinymqtt.json");
+ *
+ * The file is in the Chrome trace event format, it opens in Perfetto
+ * (ui.perfetto.dev) or chrome://tracing. Each stage is a slice: socket
+ * read, parse, process_message, intern, fanout, match, write, publish (by a
+ * local client), and the gateway dispatch, property updates and syncs. The
+ * slices of one packet share its number (args.msg), including when a local
+ * client of the same thread receives it, so a slow message can be followed
+ * from the socket to the gateway properties.
+ *
+ * Recording costs two clock reads and an atomic increment per slice; once
+ * the capacity is reached, new events are ignored. Without TINY_MQTT_TRACE,
+ * the macros compile to nothing.
+ */
+#ifdef TINY_MQTT_TRACE
+#include <atomic>
+
+class MqttTrace
+{
+  public:
+    struct Event
+    {
+      const char* name;   // string literal
+      uint64_t start;     // ns since start()
+      uint32_t duration;  // ns
+      uint32_t message;   // 0 if none
+      uint16_t thread;
+    };
+
+    /** Allocates capacity events and clears the previous ones. Must be
+        called before the traced threads run */
+    static void start(size_t capacity);
+    static void stop() { recording = false; }
+
+    static uint64_t now();  // ns
+    static void add(const char* name, uint64_t start, uint64_t end);
+    static size_t size();
+
+    /** Writes the events as Chrome trace event JSON */
+    static void write(FILE*);
+    static bool save(const char* path);
+
+    /** Number of the packet being processed by this thread, 0 if none */
+    static uint32_t message() { return current_message; }
+
+  private:
+    friend class MqttTraceMessage;
+
+    static Event* events;
+    static size_t capacity;
+    static std::atomic<size_t> next;
+    static std::atomic<uint32_t> messages;
+    static uint64_t origin;
+    static volatile bool recording;
+    static thread_local uint32_t current_message;
+};
+
+/** Slice from its creation to end() or its destruction */
+class MqttTraceScope
+{
+  public:
+    MqttTraceScope(const char* name) : name(name), start(MqttTrace::now()) {}
+    ~MqttTraceScope() { end(); }
+
+    void end()
+    {
+      if (name) MqttTrace::add(name, start, MqttTrace::now());
+      name = nullptr;
+    }
+
+  private:
+    const char* name;
+    uint64_t start;
+};
+
+/** Gives a number to the packet processed in its scope, unless this thread
+    already processes one (a local client receiving a publish) */
+class MqttTraceMessage
+{
+  public:
+    MqttTraceMessage() : outer(MqttTrace::current_message)
+    {
+      if (outer == 0) MqttTrace::current_message = ++MqttTrace::messages;
+    }
+    /** Resumes the trace of a packet received before (see MqttClient::Delivery) */
+    MqttTraceMessage(uint32_t message) : outer(MqttTrace::current_message)
+    {
+      MqttTrace::current_message = message;
+    }
+    ~MqttTraceMessage() { MqttTrace::current_message = outer; }
+
+  private:
+    uint32_t outer;
+};
+
+  #define TM_TRACE_CONCAT2(a, b) a##b
+  #define TM_TRACE_CONCAT(a, b) TM_TRACE_CONCAT2(a, b)
+  #define TM_TRACE_SCOPE(name) MqttTraceScope TM_TRACE_CONCAT(tm_trace_, __LINE__)(name)
+  #define TM_TRACE_BEGIN(var, name) MqttTraceScope var(name)
+  #define TM_TRACE_END(var) var.end()
+  #define TM_TRACE_MESSAGE() MqttTraceMessage TM_TRACE_CONCAT(tm_trace_msg_, __LINE__)
+#else
+  #define TM_TRACE_SCOPE(name)
+  #define TM_TRACE_BEGIN(var, name)
+  #define TM_TRACE_END(var)
+  #define TM_TRACE_MESSAGE()
+#endif
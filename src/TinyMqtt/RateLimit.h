@@ -0,0 +1,78 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stdint.h>
+
+/***
+ * Limits applied by a broker to the publishes of each of its tcp clients,
+ * so that one flooding device (say a Tasmota with TelePeriod 1) cannot
+ * starve the others. See MqttBroker::setRateLimit().
+ *
+ * A client may send bursts of up to *_burst messages / bytes, then is
+ * limited to the *_per_sec rates. A rate of 0 disables that limit.
+ * A publish larger than byte_burst counts as byte_burst bytes: it is
+ * accepted when the bucket is full.
+ */
+struct MqttRateLimit
+{
+  enum __attribute__((packed)) Action
+  {
+    Drop,        // Ignore publishes over the limit
+    Delay,       // Stop reading the client until it is back under the limit
+                 // (same as Drop with TINY_MQTT_ASYNC)
+    Disconnect   // Close the connection
+  };
+
+  uint32_t messages_per_sec = 0;
+  uint32_t message_burst = 0;     // defaults to messages_per_sec
+  uint32_t bytes_per_sec = 0;
+  uint32_t byte_burst = 0;        // defaults to bytes_per_sec
+  Action action = Drop;
+
+  bool enabled() const { return messages_per_sec or bytes_per_sec; }
+};
+
+/** Publishes that exceeded the limit, by action taken */
+struct MqttRateStats
+{
+  uint32_t dropped = 0;
+  uint32_t delayed = 0;
+  uint32_t disconnected = 0;
+};
+
+/***
+ * Token bucket counting thousandths of tokens, so that slow rates refill
+ * without floating point. The level may become negative (debt) when a
+ * message is accepted anyway (Delay action).
+ */
+class TokenBucket
+{
+  public:
+    void reset(uint32_t burst, uint32_t now)
+    {
+      level = static_cast<int64_t>(burst) * 1000;
+      last = now;
+    }
+
+    void refill(uint32_t rate, uint32_t burst, uint32_t now)
+    {
+      level += static_cast<int64_t>(now - last) * rate;
+      last = now;
+      int64_t full = static_cast<int64_t>(burst) * 1000;
+      if (level > full) level = full;
+    }
+
+    bool has(uint32_t tokens) const { return level >= static_cast<int64_t>(tokens) * 1000; }
+    void take(uint32_t tokens) { level -= static_cast<int64_t>(tokens) * 1000; }
+
+    /** Time until the bucket, refilled at rate, is no longer in debt */
+    uint32_t msUntilPaid(uint32_t rate, uint32_t now) const
+    {
+      int64_t debt = -level - static_cast<int64_t>(now - last) * rate;
+      if (debt <= 0 or rate == 0) return 0;
+      return static_cast<uint32_t>((debt + rate - 1) / rate);
+    }
+
+  private:
+    int64_t level = 0;
+    uint32_t last = 0;
+};
@@ -0,0 +1,194 @@
+// vim: ts=2 sw=2 expandtab
+#ifdef TINY_MQTT_EPOLL
+#include "ShmRing.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <new>
+
+static size_t alignUp(size_t size, size_t align)
+{
+  return (size + align - 1) & ~(align - 1);
+}
+
+MqttShmRing::~MqttShmRing()
+{
+  if (header) munmap(header, mapped);
+}
+
+bool MqttShmWriter::open(const char* name, size_t capacity, mode_t mode)
+{
+  if (header) return false;
+  size_t cap = Align * 16;
+  while(cap < capacity) cap <<= 1;
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, mode);
+  if (fd < 0) return false;
+  size_t size = sizeof(Header) + cap;
+  void* mem = MAP_FAILED;
+  // fchmod: an existing object keeps the mode it was created with
+  if (fchmod(fd, mode) == 0 and ftruncate(fd, size) == 0)
+    mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  header = new (mem) Header;
+  header->magic = 0;  // not usable by readers until initialized
+  header->record_align = Align;
+  header->capacity = cap;
+  header->claimed.store(0);
+  header->messages.store(0);
+  header->head.store(0);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = Magic;
+  mapped = size;
+  return true;
+}
+
+bool MqttShmWriter::write(const char* topic, uint16_t topic_len, const char* payload, size_t length)
+{
+  if (header == nullptr) return false;
+  const uint64_t cap = header->capacity;
+  const size_t need = alignUp(sizeof(Record) + topic_len + length, Align);
+  if (need > cap/2) return false;
+
+  char* ring = const_cast<char*>(data());
+  uint64_t pos = header->head.load(std::memory_order_relaxed);
+  size_t offset = pos & (cap-1);
+  size_t skip = (offset + need > cap) ? cap - offset : 0;
+
+  // Tell the readers which bytes are about to be overwritten (seqlock style)
+  header->claimed.store(pos + skip + need, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  if (skip)
+  {
+    Record wrap = { static_cast<uint32_t>(skip), 0, RecordWrap, 0, 0 };
+    memcpy(ring + offset, &wrap, sizeof(wrap));
+    pos += skip;
+    offset = 0;
+  }
+
+  uint64_t sequence = header->messages.load(std::memory_order_relaxed);
+  Record record = { static_cast<uint32_t>(need), topic_len, 0, static_cast<uint32_t>(length), static_cast<uint32_t>(sequence) };
+  memcpy(ring + offset, &record, sizeof(record));
+  memcpy(ring + offset + sizeof(record), topic, topic_len);
+  if (length) memcpy(ring + offset + sizeof(record) + topic_len, payload, length);
+
+  // messages before head: when claimed == head, messages counts the records up to head
+  header->messages.store(sequence + 1, std::memory_order_relaxed);
+  header->head.store(pos + need, std::memory_order_release);
+  return true;
+}
+
+bool MqttShmReader::open(const char* name)
+{
+  if (header) return false;
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return false;
+  struct stat st;
+  void* mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0 and static_cast<size_t>(st.st_size) > sizeof(Header))
+    mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  Header* hdr = static_cast<Header*>(mem);
+  if (hdr->magic != Magic or hdr->record_align != Align
+      or sizeof(Header) + hdr->capacity > static_cast<size_t>(st.st_size))
+  {
+    munmap(mem, st.st_size);
+    return false;
+  }
+  header = hdr;
+  mapped = st.st_size;
+  resync();
+  lost_count = 0;
+  return true;
+}
+
+void MqttShmReader::resync()
+{
+  // head and messages agree when no record was being written during the reads
+  uint64_t head, messages;
+  for(int tries = 0; ; tries++)
+  {
+    uint64_t claimed = header->claimed.load(std::memory_order_acquire);
+    messages = header->messages.load(std::memory_order_acquire);
+    head = header->head.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (claimed == head and header->claimed.load(std::memory_order_relaxed) == claimed) break;
+    if (tries == 100)
+    {
+      // Writer too busy: the next records read correct the count
+      head = header->head.load(std::memory_order_acquire);
+      break;
+    }
+  }
+  if (messages > next_sequence) lost_count += messages - next_sequence;
+  next_sequence = messages;
+  tail = head;
+}
+
+bool MqttShmReader::overwritten(uint64_t pos) const
+{
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return header->claimed.load(std::memory_order_relaxed) - pos > header->capacity;
+}
+
+size_t MqttShmReader::poll(Handler handler, void* context)
+{
+  if (header == nullptr) return 0;
+  const uint64_t cap = header->capacity;
+  const char* ring = data();
+  size_t count = 0;
+
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  while(tail < head)
+  {
+    if (overwritten(tail))
+    {
+      // Lapped by the writer, resume at its current position
+      resync();
+      break;
+    }
+    Record record;
+    memcpy(&record, ring + (tail & (cap-1)), sizeof(record));
+    if (overwritten(tail)
+        or record.size < sizeof(Record) or record.size > cap
+        or ((record.flags & RecordWrap) == 0 and sizeof(Record) + record.topic_len + record.payload_len > record.size))
+    {
+      resync();
+      break;
+    }
+    if ((record.flags & RecordWrap) == 0)
+    {
+      // Messages skipped without noticing a lap (see resync)
+      uint32_t gap = record.sequence - static_cast<uint32_t>(next_sequence);
+      if (gap < 0x80000000u)
+      {
+        lost_count += gap;
+        next_sequence += gap;
+      }
+      // Copied then checked: the writer may overwrite the record meanwhile
+      size_t length = record.topic_len + record.payload_len;
+      if (copy.size() < length) copy.resize(length);
+      memcpy(copy.data(), ring + (tail & (cap-1)) + sizeof(Record), length);
+      if (overwritten(tail))
+      {
+        resync();  // counts this record as lost
+        break;
+      }
+      handler(context, copy.data(), record.topic_len, copy.data() + record.topic_len, record.payload_len);
+      count++;
+      next_sequence++;
+    }
+    tail += record.size;
+  }
+  return count;
+}
+
+#endif
@@ -0,0 +1,105 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#ifdef TINY_MQTT_EPOLL
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+
+/***
+ * Shared memory transport for co-located processes (TINY_MQTT_EPOLL).
+ *
+ * The broker writes every publish once in a POSIX shared memory ring
+ * (see MqttBroker::shareMemory). Any number of processes on the same
+ * machine map the ring read-only with MqttShmReader and get the topic and
+ * the payload with a copy, without a syscall per message. The copy is
+ * checked against the writer before the message is handed over, so a
+ * reader never sees a record torn by an overwrite.
+ *
+ * The ring never blocks the broker: a reader that is lapped loses the
+ * overwritten messages, and lost() tells how many.
+ */
+class MqttShmRing
+{
+  protected:
+    static const uint32_t Magic = 0x544D5152;  // "TMQR"
+
+    struct Header
+    {
+      uint32_t magic;
+      uint32_t record_align;
+      uint64_t capacity;                // power of 2
+      std::atomic<uint64_t> claimed;    // end of the record being written
+      std::atomic<uint64_t> messages;   // records written, including the one at head
+      char pad[32];                     // keeps readers' cache line clean
+      std::atomic<uint64_t> head;       // end of the last complete record
+    };
+
+    struct Record
+    {
+      uint32_t size;        // whole record, aligned
+      uint16_t topic_len;
+      uint16_t flags;
+      uint32_t payload_len;
+      uint32_t sequence;    // number of the message (low 32 bits)
+    };
+
+    enum : uint16_t { RecordWrap = 1 };
+    static const size_t Align = sizeof(Record);
+
+    MqttShmRing() {}
+    ~MqttShmRing();
+    MqttShmRing(const MqttShmRing&) = delete;
+    MqttShmRing& operator=(const MqttShmRing&) = delete;
+
+    const char* data() const { return reinterpret_cast<const char*>(header+1); }
+
+    Header* header = nullptr;
+    size_t mapped = 0;
+};
+
+class MqttShmWriter : public MqttShmRing
+{
+  public:
+    /** Creates (or resets) the shared memory object /name of capacity bytes
+        (rounded to a power of 2). Readers need the read permission of mode:
+        only the user of the broker by default */
+    bool open(const char* name, size_t capacity, mode_t mode = 0600);
+    bool isOpen() const { return header != nullptr; }
+
+    /** Returns false if the message is larger than half the ring */
+    bool write(const char* topic, uint16_t topic_len, const char* payload, size_t length);
+};
+
+class MqttShmReader : public MqttShmRing
+{
+  public:
+    using Handler = void (*)(void* context, const char* topic, uint16_t topic_len, const char* payload, size_t length);
+
+    /** Maps an existing ring, only messages written after open() are read */
+    bool open(const char* name);
+    bool isOpen() const { return header != nullptr; }
+
+    /** Calls handler for each new message; topic and payload point to a
+        copy that is valid during the call only. Records overwritten while
+        they were copied are skipped and counted in lost().
+        Returns the number of messages read */
+    size_t poll(Handler handler, void* context = nullptr);
+
+    /** Messages overwritten by the broker before this reader got them */
+    uint64_t lost() const { return lost_count; }
+
+  private:
+    bool overwritten(uint64_t pos) const;
+    // Moves to the current head, counts the messages skipped
+    void resync();
+
+    uint64_t tail = 0;
+    uint64_t next_sequence = 0;   // of the record at tail
+    uint64_t lost_count = 0;
+    std::vector<char> copy;       // topic and payload of the current record
+};
+
+#endif
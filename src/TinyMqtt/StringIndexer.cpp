@@ -1,4 +1,4 @@
 #include "StringIndexer.h"
 
-StringIndexer::Strings StringIndexer::strings;
+TINY_MQTT_THREAD_LOCAL StringIndexer::Strings StringIndexer::strings;
 
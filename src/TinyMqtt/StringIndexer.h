@@ -6,8 +6,18 @@
 #include "TinyConsole.h"
 #include <string>
 #include <string.h>
+#include "MqttMemory.h"
 
 using string = TinyConsole::string;
+using TopicString = MqttString<MqttMemory::Topics>;
+
+// Host builds can run one broker per thread (see MqttReactor.h),
+// each thread then owns its own table of strings.
+#ifdef TINY_MQTT_EPOLL
+  #define TINY_MQTT_THREAD_LOCAL thread_local
+#else
+  #define TINY_MQTT_THREAD_LOCAL
+#endif
 
 /***
  * Allows to store up to 255 different strings with one byte class
@@ -19,7 +29,7 @@ class StringIndexer
 
   class StringCounter
   {
-    string str;
+    TopicString str;
     uint8_t used=0;
     friend class StringIndexer;
 
@@ -36,9 +46,9 @@ class StringIndexer
   public:
     using index_t = uint8_t;
 
-   static const string& str(const index_t& index)
+   static const TopicString& str(const index_t& index)
    {
-     static string dummy;
+     static TopicString dummy;
      const auto& it=strings.find(index);
      if (it == strings.end()) return dummy;
      return it->second.str;
@@ -50,21 +60,33 @@ class StringIndexer
       if (it != strings.end()) it->second.used++;
     }
 
+    // An unused string is kept until its index is needed by another one:
+    // a topic published again and again is then interned without allocation
     static void release(const index_t& index)
     {
       auto it=strings.find(index);
-      if (it != strings.end())
+      if (it != strings.end() and it->second.used) it->second.used--;
+    }
+
+    // Frees the strings kept unused (see release)
+    static void purge()
+    {
+      for(auto it=strings.begin(); it!=strings.end();)
       {
-        it->second.used--;
         if (it->second.used == 0)
-        {
-          strings.erase(it);
-          // Serial << "Removing string(" << it->second.str.c_str() << ") size=" << strings.size() << endl;
-        }
+          it = strings.erase(it);
+        else
+          ++it;
       }
     }
 
-    static uint16_t count() { return strings.size(); }
+    static uint16_t count()
+    {
+      uint16_t n=0;
+      for(const auto& it: strings)
+        if (it.second.used) n++;
+      return n;
+    }
 
   private:
     friend class IndexedString;
@@ -74,7 +96,7 @@ class StringIndexer
     {
       for(auto it=strings.begin(); it!=strings.end(); it++)
       {
-        if (it->second.str.length() == len && strcmp(it->second.str.c_str(), str)==0)
+        if (it->second.str.length() == len && memcmp(it->second.str.c_str(), str, len)==0)
         {
           it->second.used++;
           return it->first;
@@ -84,18 +106,29 @@ class StringIndexer
       {
         if (strings.find(index)==strings.end())
         {
-          strings[index].str = string(str, len);
+          strings[index].str.assign(str, len);
           strings[index].used++;
           // Serial << "Creating index " << index << " for (" << strings[index].str.c_str() << ") len=" << len << endl;
           return index;
         }
       }
+      // All indexes exist, reuse the one of an unused string
+      for(auto it=strings.begin(); it!=strings.end(); it++)
+      {
+        if (it->second.used == 0)
+        {
+          it->second.str.assign(str, len);
+          it->second.used++;
+          return it->first;
+        }
+      }
       return 0;  // TODO out of indexes
     }
 
-    using Strings = std::unordered_map<index_t, StringCounter>;
+    using Strings = std::unordered_map<index_t, StringCounter, std::hash<index_t>, std::equal_to<index_t>,
+      MqttAllocator<std::pair<const index_t, StringCounter>, MqttMemory::Topics>>;
 
-    static Strings strings;
+    static TINY_MQTT_THREAD_LOCAL Strings strings;
 };
 
 class IndexedString
@@ -133,7 +166,7 @@ class IndexedString
       return i1.index == i2.index;
     }
 
-    const string& str() const { return StringIndexer::str(index); }
+    const TopicString& str() const { return StringIndexer::str(index); }
 
     const StringIndexer::index_t& getIndex() const { return index; }
 
@@ -0,0 +1,419 @@
+// vim: ts=2 sw=2 expandtab
+#ifdef TINY_MQTT_EPOLL
+#include "TcpEpoll.h"
+#include "MqttMetrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Stop draining a socket once this many bytes are waiting to be parsed,
+// the remaining bytes are read when the buffer has been consumed.
+static const size_t MaxRxBacklog = 64*1024;
+// A peer that leaves this many bytes unread is closed, instead of having
+// every message for it buffered until the host runs out of memory.
+static const size_t MaxTxBacklog = 1024*1024;
+static const int MaxEvents = 256;
+
+static void setNonBlocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void setNoDelay(int fd)
+{
+  int one = 1;
+  // Fails silently on Unix domain sockets
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+EpollClient::Socket::~Socket()
+{
+  if (fd >= 0) ::close(fd);  // also removes fd from the epoll set
+  if (auto other = peer.lock()) other->eof = true;
+}
+
+void EpollClient::Socket::receive(const char* buf, size_t len)
+{
+  if (rx_pos == rx.size())
+  {
+    rx.clear();
+    rx_pos = 0;
+  }
+  rx.append(buf, len);
+  if (server) server->memory_ready = true;
+}
+
+void EpollClient::Socket::drain()
+{
+  if (fd < 0) return;
+  if (rx_pos == rx.size())
+  {
+    rx.clear();
+    rx_pos = 0;
+  }
+  char buf[4096];
+  while(pending() < MaxRxBacklog)
+  {
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n > 0)
+      rx.append(buf, n);
+    else if (n == 0)
+    {
+      eof = true;
+      break;
+    }
+    else if (errno == EINTR)
+      continue;
+    else
+    {
+      if (errno != EAGAIN and errno != EWOULDBLOCK) eof = true;
+      break;
+    }
+  }
+}
+
+void EpollClient::Socket::flush()
+{
+  size_t sent = 0;
+  while(fd >= 0 and sent < tx.size())
+  {
+    ssize_t n = ::send(fd, tx.data()+sent, tx.size()-sent, MSG_NOSIGNAL);
+    if (n > 0)
+      sent += n;
+    else if (n < 0 and errno == EINTR)
+      continue;
+    else
+    {
+      if (n < 0 and errno != EAGAIN and errno != EWOULDBLOCK) eof = true;
+      break;
+    }
+  }
+  tx.erase(0, sent);
+  if (watched and server and writing != (tx.size() > 0)) server->watch(this, tx.size() > 0);
+}
+
+EpollClient::EpollClient(int fd)
+  : sock(std::make_shared<Socket>())
+{
+  sock->fd = fd;
+  setNonBlocking(fd);
+  setNoDelay(fd);
+}
+
+int EpollClient::connect(const char* host, uint16_t port)
+{
+  stop();
+  if (host[0] == '/')  // Unix domain socket path
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(host) >= sizeof(addr.sun_path)) return 0;
+    strcpy(addr.sun_path, host);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+      ::close(fd);
+      return 0;
+    }
+    *this = EpollClient(fd);
+    return 1;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo* res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[6];
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &res) != 0) return 0;
+
+  int fd = -1;
+  for(struct addrinfo* ai = res; ai; ai = ai->ai_next)
+  {
+    fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    ::close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) return 0;
+
+  *this = EpollClient(fd);
+  return 1;
+}
+
+bool EpollClient::connected()
+{
+  if (not sock or not sock->open()) return false;
+  return sock->pending() or not sock->eof;
+}
+
+int EpollClient::available()
+{
+  if (not sock) return 0;
+  // Unwatched sockets (outgoing connections) and sockets whose draining was
+  // suspended because of MaxRxBacklog are read on demand.
+  if (sock->pending() == 0 and not sock->eof and (not sock->watched or sock->rx.size() >= MaxRxBacklog))
+    sock->drain();
+  return sock->pending();
+}
+
+int EpollClient::read()
+{
+  if (available() == 0) return -1;
+  return static_cast<unsigned char>(sock->rx[sock->rx_pos++]);
+}
+
+int EpollClient::read(uint8_t* buf, size_t len)
+{
+  size_t avail = available();
+  if (avail == 0) return -1;
+  if (len > avail) len = avail;
+  memcpy(buf, sock->rx.data()+sock->rx_pos, len);
+  sock->rx_pos += len;
+  return len;
+}
+
+size_t EpollClient::write(const char* buf, size_t len)
+{
+  if (not sock or not sock->open() or sock->eof) return 0;
+  if (sock->memory)
+  {
+    auto other = sock->peer.lock();
+    if (not other or other->eof) return 0;
+    if (other->pending() + len > MaxTxBacklog)
+    {
+      MqttMetrics::count(MqttMetrics::SlowClients);
+      sock->eof = other->eof = true;
+      return 0;
+    }
+    other->receive(buf, len);
+    return len;
+  }
+  if (sock->tx.size() + len > MaxTxBacklog)
+  {
+    MqttMetrics::count(MqttMetrics::SlowClients);
+    sock->eof = true;  // closed by its owner, see connected()
+    return 0;
+  }
+  sock->tx.append(buf, len);
+  sock->flush();
+  return len;
+}
+
+void EpollClient::stop()
+{
+  if (not sock) return;
+  if (sock->fd >= 0)
+  {
+    if (sock->tx.size())
+    {
+      // Best effort: the socket is about to be closed
+      ::send(sock->fd, sock->tx.data(), sock->tx.size(), MSG_NOSIGNAL);
+    }
+    ::close(sock->fd);
+    sock->fd = -1;
+  }
+  sock->eof = true;
+  if (auto other = sock->peer.lock()) other->eof = true;
+  sock.reset();
+}
+
+EpollServer::EpollServer(uint16_t port) : port(port) {}
+
+EpollServer::~EpollServer()
+{
+  if (listen_fd >= 0) ::close(listen_fd);
+  if (unix_fd >= 0)
+  {
+    ::close(unix_fd);
+    ::unlink(unix_path.c_str());
+  }
+  if (wake_fd >= 0) ::close(wake_fd);
+  if (epoll_fd >= 0) ::close(epoll_fd);
+}
+
+void EpollServer::init()
+{
+  if (epoll_fd >= 0) return;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  struct epoll_event ev;
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = this;     // this is the wakeup event
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+bool EpollServer::addListener(int fd, const struct sockaddr* addr, socklen_t len)
+{
+  if (fd < 0) return false;
+  if (::bind(fd, addr, len) < 0 or ::listen(fd, SOMAXCONN) < 0)
+  {
+    ::close(fd);
+    return false;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = nullptr;  // nullptr is a listening socket
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  return true;
+}
+
+void EpollServer::begin()
+{
+  init();
+  if (listen_fd >= 0) return;
+  int fd = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return;
+
+  int one = 1;
+  int zero = 0;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (reuse_port) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (addListener(fd, (struct sockaddr*)&addr, sizeof(addr))) listen_fd = fd;
+}
+
+bool EpollServer::listenUnix(const char* path)
+{
+  init();
+  if (unix_fd >= 0) return false;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, path);
+  ::unlink(path);  // stale socket of a previous run
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (not addListener(fd, (struct sockaddr*)&addr, sizeof(addr))) return false;
+  unix_fd = fd;
+  unix_path = path;
+  return true;
+}
+
+void EpollServer::wakeup()
+{
+  uint64_t one = 1;
+  if (wake_fd >= 0 and ::write(wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+void EpollServer::watch(EpollClient::Socket* s, bool want_write)
+{
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (want_write ? (uint32_t)EPOLLOUT : 0u);
+  ev.data.ptr = s;
+  epoll_ctl(epoll_fd, s->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &ev);
+  s->watched = true;
+  s->writing = want_write;
+}
+
+void EpollServer::add(EpollClient& client)
+{
+  if (not client.sock or client.sock->fd < 0 or client.sock->watched) return;
+  init();
+  client.sock->server = this;
+  watch(client.sock.get(), client.sock->tx.size() > 0);
+}
+
+void EpollServer::acceptAll(int listener)
+{
+  // Edge triggered: accept until the backlog is empty
+  while(listener >= 0)
+  {
+    int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR) continue;
+      break;
+    }
+    EpollClient client(fd);
+    client.sock->server = this;
+    watch(client.sock.get(), false);
+    // Data may have arrived before registration
+    client.sock->drain();
+    pending.push_back(client);
+  }
+}
+
+EpollClient EpollServer::connectMemory()
+{
+  EpollClient client;
+  EpollClient accepted;
+  client.sock = std::make_shared<EpollClient::Socket>();
+  accepted.sock = std::make_shared<EpollClient::Socket>();
+  client.sock->memory = accepted.sock->memory = true;
+  client.sock->peer = accepted.sock;
+  accepted.sock->peer = client.sock;
+  accepted.sock->server = this;
+  pending.push_back(accepted);
+  memory_ready = true;
+  return client;
+}
+
+int EpollServer::poll(int timeout_ms)
+{
+  // In-memory connections have no event to wait for
+  int ready = memory_ready.exchange(false);
+  if (epoll_fd < 0) return ready ? ready : -1;
+  struct epoll_event events[MaxEvents];
+  int n = epoll_wait(epoll_fd, events, MaxEvents, ready ? 0 : timeout_ms);
+  if (n < 0) return errno == EINTR ? ready : -1;
+
+  for(int i=0; i<n; i++)
+  {
+    auto s = static_cast<EpollClient::Socket*>(events[i].data.ptr);
+    if (s == nullptr)
+    {
+      acceptAll(listen_fd);
+      acceptAll(unix_fd);
+      continue;
+    }
+    if (events[i].data.ptr == this)
+    {
+      uint64_t count;
+      if (::read(wake_fd, &count, sizeof(count)) < 0) {}
+      continue;
+    }
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      s->drain();
+    if (events[i].events & (EPOLLHUP | EPOLLERR))
+      s->eof = true;
+    if (events[i].events & EPOLLOUT)
+      s->flush();
+  }
+  return n + ready;
+}
+
+EpollClient EpollServer::accept()
+{
+  poll(0);
+  if (pending.empty()) return EpollClient();
+  EpollClient client = pending.front();
+  pending.pop_front();
+  return client;
+}
+
+#endif
@@ -0,0 +1,135 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#ifdef TINY_MQTT_EPOLL
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+
+/***
+ * Linux host transport (TINY_MQTT_EPOLL).
+ *
+ * EpollClient / EpollServer mimic the subset of WiFiClient / WiFiServer
+ * used by TinyMqtt, so MqttBroker runs unchanged as a native process.
+ *
+ * All sockets are non-blocking. Sockets accepted by an EpollServer are
+ * registered in its edge-triggered epoll set: when readiness is reported,
+ * the socket is drained into its receive buffer, so available() and read()
+ * never issue a syscall on idle connections. What a peer does not read is
+ * buffered up to 1 MB, then its connection is closed and counted in
+ * MqttMetrics::SlowClients.
+ *
+ * EpollServer::connectMemory() also creates connections without socket:
+ * writing to one end appends to the receive buffer of the other. They let
+ * benchmarks run thousands of clients in one thread without the kernel.
+ */
+class EpollServer;
+
+class EpollClient
+{
+  struct Socket
+  {
+    int fd = -1;
+    bool eof = false;
+    bool watched = false;   // registered in a server epoll set
+    bool writing = false;   // EPOLLOUT requested
+    std::string rx;
+    size_t rx_pos = 0;
+    std::string tx;         // bytes not accepted yet by the kernel
+    EpollServer* server = nullptr;
+    bool memory = false;        // see EpollServer::connectMemory()
+    std::weak_ptr<Socket> peer;
+
+    ~Socket();
+    void drain();
+    void flush();
+    void receive(const char* buf, size_t len);  // from the memory peer
+    bool open() const { return fd >= 0 or memory; }
+    size_t pending() const { return rx.size() - rx_pos; }
+  };
+
+  public:
+    EpollClient() {}
+
+    explicit operator bool() const { return sock and sock->open(); }
+
+    /** Blocking connect, the socket is switched to non-blocking afterwards.
+        A host starting with '/' is the path of a Unix domain socket */
+    int connect(const char* host, uint16_t port);
+    bool connected();
+    int available();
+    int read();
+    int read(uint8_t* buf, size_t len);
+    size_t write(const char* buf, size_t len);
+    void stop();
+    int fd() const { return sock ? sock->fd : -1; }
+
+  private:
+    friend class EpollServer;
+    explicit EpollClient(int fd);
+
+    std::shared_ptr<Socket> sock;
+};
+
+class EpollServer
+{
+  public:
+    EpollServer(uint16_t port);
+    ~EpollServer();
+
+    /** Allows several servers (usually one per thread) to listen on the
+        same port, the kernel then balances new connections between them.
+        Must be called before begin() */
+    void reusePort(bool enable) { reuse_port = enable; }
+
+    void begin();
+
+    /** Also accept connections on a Unix domain socket, for co-located
+        processes. Can be called before or after begin() */
+    bool listenUnix(const char* path);
+
+    /** Process pending readiness events then return a new connection (if any) */
+    EpollClient accept();
+    bool hasClient() { poll(0); return pending.size(); }
+    size_t backlog() const { return pending.size(); }
+
+    /** Waits at most timeout_ms (-1 forever) for events, and dispatch them.
+        Returns the number of events processed, or -1 on error */
+    int poll(int timeout_ms);
+
+    int fd() const { return epoll_fd; }
+
+    /** Registers a client created elsewhere (outgoing connection) */
+    void add(EpollClient& client);
+
+    /** Returns the client end of a new in-memory connection, whose server
+        end is returned by the next accept(). Both ends must be used by the
+        thread of the server */
+    EpollClient connectMemory();
+
+    /** Interrupts a poll() in progress. Can be called from any thread */
+    void wakeup();
+
+  private:
+    friend class EpollClient;
+    void init();
+    bool addListener(int fd, const struct sockaddr* addr, socklen_t len);
+    void acceptAll(int listener);
+    void watch(EpollClient::Socket*, bool want_write);
+
+    uint16_t port;
+    bool reuse_port = false;
+    int listen_fd = -1;
+    int unix_fd = -1;
+    std::string unix_path;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::deque<EpollClient> pending;
+    std::atomic<bool> memory_ready{false};  // data written to an in-memory connection, maybe by fan-out workers
+};
+
+#endif
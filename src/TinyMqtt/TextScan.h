@@ -0,0 +1,72 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define TINY_MQTT_SCAN_AVX2
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define TINY_MQTT_SCAN_SSE2
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define TINY_MQTT_SCAN_NEON
+#endif
+
+/***
+ * Vectorized character search used by the topic matcher and the gateway
+ * JSON field extractor. AVX2, SSE2 or NEON kernels are selected at compile
+ * time from the target flags, other targets (ESP32) use the scalar loop.
+ */
+namespace TextScan
+{
+  /** Returns the index of the first char of s that is one of set[0..nset),
+      or len if there is none */
+  inline size_t findAnyOf(const char* s, size_t len, const char* set, size_t nset)
+  {
+    size_t i = 0;
+#if defined(TINY_MQTT_SCAN_AVX2)
+    for(; i + 32 <= len; i += 32)
+    {
+      __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+      __m256i hits = _mm256_setzero_si256();
+      for(size_t c = 0; c < nset; c++)
+        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(set[c])));
+      uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits));
+      if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+#if defined(TINY_MQTT_SCAN_AVX2) || defined(TINY_MQTT_SCAN_SSE2)
+    for(; i + 16 <= len; i += 16)
+    {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+      __m128i hits = _mm_setzero_si128();
+      for(size_t c = 0; c < nset; c++)
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(set[c])));
+      uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hits));
+      if (mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(TINY_MQTT_SCAN_NEON)
+    for(; i + 16 <= len; i += 16)
+    {
+      uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t*>(s + i));
+      uint8x16_t hits = vdupq_n_u8(0);
+      for(size_t c = 0; c < nset; c++)
+        hits = vorrq_u8(hits, vceqq_u8(block, vdupq_n_u8(static_cast<uint8_t>(set[c]))));
+      // Narrow to 4 bits per byte to get a scalar mask
+      uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+      if (mask) return i + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for(; i < len; i++)
+      for(size_t c = 0; c < nset; c++)
+        if (s[i] == set[c]) return i;
+    return len;
+  }
+
+  inline size_t find(const char* s, size_t len, char c)
+  {
+    return findAnyOf(s, len, &c, 1);
+  }
+}
@@ -11,23 +11,44 @@ static auto yellow = TinyConsole::yellow;
 int TinyMqtt::debug=2;
 #endif
 
-#ifdef EPOXY_DUINO
-  std::map<MqttMessage::Type, int> MqttClient::counters;
-#endif
-
 MqttBroker::MqttBroker(uint16_t port)
+  : created(millis())
 {
   server = new TcpServer(port);
+  if (MqttConfig::MaxClients) clients.reserve(MqttConfig::MaxClients);
 #ifdef TINY_MQTT_ASYNC
   server->onClient(onClient, this);
 #endif
 }
 
 MqttBroker::~MqttBroker()
+{
+  removeAllClients();
+  delete server;
+  delete sys_snapshot;
+#ifdef TINY_MQTT_EPOLL
+  delete shm_writer;
+#endif
+}
+
+#ifdef TINY_MQTT_EPOLL
+bool MqttBroker::shareMemory(const char* name, size_t capacity, mode_t mode)
+{
+  if (shm_writer) return false;
+  shm_writer = new MqttShmWriter;
+  if (shm_writer->open(name, capacity, mode)) return true;
+  delete shm_writer;
+  shm_writer = nullptr;
+  return false;
+}
+#endif
+
+void MqttBroker::removeAllClients()
 {
   while(clients.size())
   {
     auto client = clients[0];
+    unsubscribeAll(client);
     client->local_broker = nullptr;
     if (client->cltFlags & MqttClient::CltFlags::CltFlagToDelete)
     {
@@ -35,8 +56,8 @@ MqttBroker::~MqttBroker()
       delete client;
     }
     clients.erase(clients.begin());
+    MqttMetrics::gauge(MqttMetrics::Clients, -1);
   }
-  delete server;
 }
 
 // private constructor used by broker only
@@ -45,18 +66,23 @@ MqttClient::MqttClient(MqttBroker* local_broker, TcpClient* new_client)
 {
   debug("MqttClient private with broker");
 #ifdef TINY_MQTT_ASYNC
-  tcp_client = new_client;
-  tcp_client->onData(onData, this);
-  // client->onConnect() TODO
-  // client->onDisconnect() TODO
+  attach(new_client);
 #else
-  tcp_client = new WiFiClient(*new_client);
+  tcp_client = new TcpClient(*new_client);
 #endif
-#ifdef EPOXY_DUINO
+#if defined(EPOXY_DUINO) && !defined(TINY_MQTT_EPOLL)
   alive = millis()+500000;
 #else
-  alive = millis()+5000;  // TODO MAGIC client expires after 5s if no CONNECT msg
+  alive = millis()+MqttConfig::ConnectTimeoutMs;  // client expires if no CONNECT msg
 #endif
+  resetRate(local_broker->rate_limit);
+}
+
+void MqttClient::resetRate(const MqttRateLimit& limit)
+{
+  uint32_t now = millis();
+  rate_messages.reset(limit.message_burst, now);
+  rate_bytes.reset(limit.byte_burst, now);
 }
 
 MqttClient::MqttClient(MqttBroker* local_broker, const string& id)
@@ -71,6 +97,10 @@ MqttClient::MqttClient(MqttBroker* local_broker, const string& id)
 MqttClient::~MqttClient()
 {
   close();
+  if (local_broker) local_broker->removeClient(this);
+#ifdef TINY_MQTT_ASYNC
+  detach();
+#endif
   delete tcp_client;
   debug("*** MqttClient delete()");
 }
@@ -90,7 +120,8 @@ void MqttClient::close(bool bSendDisconnect)
     tcp_client->stop();
   }
 
-  if (local_broker)
+  // Clients created by the broker are removed when MqttBroker::loop() deletes them
+  if (local_broker and not (cltFlags & CltFlagToDelete))
   {
     local_broker->removeClient(this);
     local_broker = nullptr;
@@ -110,14 +141,17 @@ void MqttClient::connect(string broker, uint16_t port, uint16_t ka)
   debug("MqttClient::connect_to_host " << broker << ':' << port);
   keep_alive = ka;
   close();
+#ifdef TINY_MQTT_ASYNC
+  detach();
+#endif
   if (tcp_client) delete tcp_client;
-  tcp_client = new TcpClient;
 
 #ifdef TINY_MQTT_ASYNC
-  tcp_client->onData(onData, this);
+  attach(new TcpClient);
   tcp_client->onConnect(onConnect, this);
-  tcp_client->connect(broker.c_str(), port, ka);
+  tcp_client->connect(broker.c_str(), port);
 #else
+  tcp_client = new TcpClient;
   if (tcp_client->connect(broker.c_str(), port))
   {
     debug("link established");
@@ -133,7 +167,79 @@ void MqttClient::connect(string broker, uint16_t port, uint16_t ka)
 void MqttBroker::addClient(MqttClient* client)
 {
   debug("MqttBroker::addClient");
+  // Smallest free slot, 0 when more than 255 clients
+  uint32_t used[8] = {};
+  for(auto other: clients) used[other->slot / 32] |= 1u << (other->slot % 32);
+  client->slot = 0;
+  for(unsigned s=1; s<256; s++)
+    if ((used[s / 32] & (1u << (s % 32))) == 0) { client->slot = s; break; }
   clients.push_back(client);
+  MqttMetrics::gauge(MqttMetrics::Clients, 1);
+  for(const auto& filter: client->subscriptions) subscribed(filter, true);
+}
+
+void MqttBroker::setRateLimit(const MqttRateLimit& limit)
+{
+  rate_limit = limit;
+  if (rate_limit.message_burst == 0) rate_limit.message_burst = rate_limit.messages_per_sec;
+  if (rate_limit.byte_burst == 0) rate_limit.byte_burst = rate_limit.bytes_per_sec;
+  for(auto client: clients)
+    if (client->tcp_client) client->resetRate(rate_limit);
+}
+
+bool MqttBroker::admit(MqttClient* client, size_t bytes)
+{
+  if (not rate_limit.enabled()) return true;
+  // A publish larger than the burst would never get enough tokens: it
+  // costs the whole burst instead, so it passes once the bucket is full
+  if (bytes > rate_limit.byte_burst) bytes = rate_limit.byte_burst;
+  uint32_t now = millis();
+  bool ok = true;
+  if (rate_limit.messages_per_sec)
+  {
+    client->rate_messages.refill(rate_limit.messages_per_sec, rate_limit.message_burst, now);
+    ok = client->rate_messages.has(1);
+  }
+  if (rate_limit.bytes_per_sec)
+  {
+    client->rate_bytes.refill(rate_limit.bytes_per_sec, rate_limit.byte_burst, now);
+    ok = ok and client->rate_bytes.has(bytes);
+  }
+  if (not ok)
+  {
+    switch(rate_limit.action)
+    {
+      case MqttRateLimit::Drop:
+        rate_stats.dropped++;
+        return false;
+      case MqttRateLimit::Delay:
+#ifdef TINY_MQTT_ASYNC
+        // AsyncTCP pushes data, the client cannot be paused
+        rate_stats.dropped++;
+        return false;
+#else
+        rate_stats.delayed++;  // accepted, but the debt stops the reads
+        break;
+#endif
+      case MqttRateLimit::Disconnect:
+        debug(red << "rate limit exceeded by " << client->id().c_str());
+        rate_stats.disconnected++;
+        client->close();
+        return false;
+    }
+  }
+  if (rate_limit.messages_per_sec) client->rate_messages.take(1);
+  if (rate_limit.bytes_per_sec) client->rate_bytes.take(bytes);
+  return true;
+}
+
+uint32_t MqttBroker::throttled(const MqttClient* client) const
+{
+  if (rate_limit.action != MqttRateLimit::Delay) return 0;
+  uint32_t now = millis();
+  uint32_t ms = client->rate_messages.msUntilPaid(rate_limit.messages_per_sec, now);
+  uint32_t ms_bytes = client->rate_bytes.msUntilPaid(rate_limit.bytes_per_sec, now);
+  return ms > ms_bytes ? ms : ms_bytes;
 }
 
 void MqttBroker::connect(const string& host, uint16_t port)
@@ -142,6 +248,9 @@ void MqttBroker::connect(const string& host, uint16_t port)
   if (remote_broker == nullptr) remote_broker = new MqttClient;
   remote_broker->connect(host, port);
   remote_broker->local_broker = this;  // Because connect removed the link
+#ifdef TINY_MQTT_EPOLL
+  if (remote_broker->tcp_client) server->add(*remote_broker->tcp_client);  // see waitForEvent()
+#endif
 }
 
 void MqttBroker::removeClient(MqttClient* remove)
@@ -158,7 +267,9 @@ void MqttBroker::removeClient(MqttClient* remove)
       // Unless -> we could receive useless messages
       //        -> we are using (memory) one IndexedString plus its string for nothing.
       debug("Remove " << clients.size());
+      unsubscribeAll(client);
       clients.erase(it);
+      MqttMetrics::gauge(MqttMetrics::Clients, -1);
       debug("Client removed " << clients.size());
       return;
     }
@@ -166,24 +277,59 @@ void MqttBroker::removeClient(MqttClient* remove)
   debug(red << "Error cannot remove client");  // TODO should not occur
 }
 
+void MqttBroker::unsubscribeAll(const MqttClient* client) const
+{
+  if (relay_subscribed == nullptr) return;
+  for(const auto& filter: client->subscriptions)
+    relay_subscribed(relay_context, filter, false);
+}
+
+size_t MqttBroker::connectionsCount() const
+{
+  size_t count = 0;
+  for(auto client: clients)
+    if (client->tcp_client) count++;
+  return count;
+}
+
 void MqttBroker::onClient(void* broker_ptr, TcpClient* client)
 {
   debug("MqttBroker::onClient");
   MqttBroker* broker = static_cast<MqttBroker*>(broker_ptr);
+  if ((MqttConfig::MaxClients and broker->connectionsCount() >= MqttConfig::MaxClients)
+      or not MqttMemory::fits(MqttMemory::Clients, sizeof(MqttClient))
+      or (broker->clients.size() == broker->clients.capacity()
+          and not MqttMemory::fits(MqttMemory::Broker, (broker->clients.size() + 1) * sizeof(MqttClient*))))
+  {
+    debug(red << "Too many clients or out of memory, connection refused");
+    MqttMetrics::count(MqttMetrics::ClientsRefused);
+#ifdef TINY_MQTT_ASYNC
+    client->close(true);
+    delete client;
+#else
+    client->stop();
+#endif
+    return;
+  }
 
+  MqttMetrics::count(MqttMetrics::ClientsAccepted);
   MqttClient* mqtt = new MqttClient(broker, client);
   mqtt->setFlag(MqttClient::CltFlags::CltFlagToDelete);
   broker->addClient(mqtt);
+  broker->notify();
   debug("New client");
 }
 
 void MqttBroker::loop()
 {
+  TM_PROFILE_SCOPE(MqttProfiler::BrokerLoop);
+  uint32_t start = MqttConfig::Metrics ? micros() : 0;
 #ifndef TINY_MQTT_ASYNC
-  WiFiClient client = server->accept();
+  TcpClient client = server->accept();
 
   if (client)
   {
+    TM_PROFILE_SCOPE(MqttProfiler::Accept);
     onClient(this, &client);
   }
 #endif
@@ -209,6 +355,234 @@ void MqttBroker::loop()
       break;
     }
   }
+
+  for(size_t i=0; i<clients.size(); i++)
+    if (clients[i]->tcp_client == nullptr and clients[i]->batch.size()) clients[i]->flushBatch();
+
+  if (MqttConfig::Metrics) MqttMetrics::record(MqttMetrics::LoopMicros, micros() - start);
+  if (sys_period and millis() - sys_last >= sys_period) publishSys();
+#if defined(ESP32) || defined(ESP8266)
+  if (pressure_threshold and millis() - pressure_last >= 1000)
+  {
+    pressure_last = millis();
+    if (ESP.getFreeHeap() < pressure_threshold) shedMemory();
+  }
+#endif
+}
+
+void MqttBroker::shedMemory()
+{
+  budget_stats.sheds++;
+  last_publish.clear();
+  for(auto client: clients) client->shrink();
+  if (remote_broker) remote_broker->shrink();
+  StringIndexer::purge();
+}
+
+bool MqttBroker::fits(const MqttClient* client, size_t more) const
+{
+  if (client_budget == 0 or client->tcp_client == nullptr) return true;
+  return client->memoryUsage() + more <= client_budget;
+}
+
+uint16_t MqttBroker::maxPacketLength(const MqttClient* client) const
+{
+  // The receive buffer is reused, only the rest of the client counts
+  size_t others = client->memoryUsage() - client->message.capacity();
+  if (others >= client_budget) return 0;
+  size_t left = client_budget - others;
+  return left < MqttConfig::MaxBufferLength ? left : MqttConfig::MaxBufferLength;
+}
+
+void MqttBroker::publishSysStats(uint32_t period_ms)
+{
+  sys_period = period_ms;
+  if (sys_period and sys_snapshot == nullptr)
+  {
+    sys_snapshot = new MqttMetrics::Snapshot;
+    MqttMetrics::snapshot(*sys_snapshot);
+    sys_last = millis();
+  }
+}
+
+void MqttBroker::publishSys(const char* name, uint32_t value) const
+{
+  char payload[12];
+  int len = snprintf(payload, sizeof(payload), "%u", static_cast<unsigned>(value));
+  publishSys(name, payload, len);
+}
+
+void MqttBroker::publishSys(const char* name, const char* payload, size_t len) const
+{
+  char topic[48];
+  snprintf(topic, sizeof(topic), "$SYS/broker/%s", name);
+
+  Topic sys(topic);
+  MqttMessage msg(MqttMessage::Publish);
+  msg.add(sys);
+  msg.add(payload, len, false);
+  msg.complete();
+  for(size_t i=0; i<clients.size(); i++)
+    clients[i]->publishIfSubscribed(sys, msg);
+}
+
+void MqttBroker::publishFlightRecorder() const
+{
+  string records;
+  records.reserve(MqttFlightRecorder::size() * sizeof(MqttFlightRecorder::Record));
+  for(size_t i=0; i<MqttFlightRecorder::size(); i++)
+    records.append(reinterpret_cast<const char*>(&MqttFlightRecorder::at(i)), sizeof(MqttFlightRecorder::Record));
+  publishSys("flight", records.c_str(), records.size());
+}
+
+void MqttBroker::publishProfile()
+{
+  char name[40];
+  char payload[96];
+  for(int phase = 0; phase < MqttProfiler::PhaseCount; phase++)
+  {
+    if (MqttProfiler::get(static_cast<MqttProfiler::Phase>(phase)).calls == 0) continue;
+    snprintf(name, sizeof(name), "profile/%s", MqttProfiler::name(static_cast<MqttProfiler::Phase>(phase)));
+    int len = MqttProfiler::format(static_cast<MqttProfiler::Phase>(phase), payload, sizeof(payload));
+    publishSys(name, payload, len);
+  }
+}
+
+void MqttBroker::publishSys()
+{
+  uint32_t now = millis();
+  uint32_t elapsed = now - sys_last;
+  sys_last = now;
+  if (elapsed == 0) elapsed = 1;
+
+  MqttMetrics::Snapshot current;
+  MqttMetrics::snapshot(current);
+  const MqttMetrics::Snapshot& last = *sys_snapshot;
+  auto perSecond = [elapsed](uint32_t now_value, uint32_t last_value)
+  {
+    return static_cast<uint32_t>((uint64_t)(now_value - last_value) * 1000 / elapsed);
+  };
+  const size_t publish = MqttMessage::Publish >> 4;
+
+  // 99th percentile of the loop durations since the last publication, as
+  // the upper bound of its log2 bucket
+  const uint32_t* loops = current.histograms[MqttMetrics::LoopMicros];
+  const uint32_t* last_loops = last.histograms[MqttMetrics::LoopMicros];
+  uint32_t total = 0;
+  for(size_t b=0; b<MqttMetrics::Buckets; b++) total += loops[b] - last_loops[b];
+  uint32_t p99 = 0;
+  uint32_t seen = 0;
+  for(size_t b=0; b<MqttMetrics::Buckets and total; b++)
+  {
+    seen += loops[b] - last_loops[b];
+    if (seen * 100ull >= total * 99ull)
+    {
+      p99 = b == 0 ? 0 : b >= 32 ? UINT32_MAX : (1u << b) - 1;
+      break;
+    }
+  }
+
+  publishSys("uptime", (now - created) / 1000);
+  publishSys("clients/connected", clients.size());
+  publishSys("load/messages/received", perSecond(current.packets_in[publish], last.packets_in[publish]));
+  publishSys("load/messages/sent", perSecond(current.packets_out[publish], last.packets_out[publish]));
+  publishSys("load/bytes/received", perSecond(current.counters[MqttMetrics::BytesIn], last.counters[MqttMetrics::BytesIn]));
+  publishSys("load/bytes/sent", perSecond(current.counters[MqttMetrics::BytesOut], last.counters[MqttMetrics::BytesOut]));
+  publishSys("messages/received", current.packets_in[publish]);
+  publishSys("messages/sent", current.packets_out[publish]);
+  publishSys("messages/dropped", rate_stats.dropped + rate_stats.disconnected);
+  publishSys("messages/suppressed", suppressed);
+#if defined(ESP32) || defined(ESP8266)
+  publishSys("heap/free", ESP.getFreeHeap());
+#endif
+  publishSys("loop/p99_us", p99);
+
+  *sys_snapshot = current;
+}
+
+bool MqttBroker::pendingWork()
+{
+#if defined(TINY_MQTT_EPOLL)
+  if (server->backlog()) return true;
+#elif !defined(TINY_MQTT_ASYNC)
+  if (server->hasClient()) return true;
+#endif
+  for(auto client: clients)
+  {
+    if (client->tcp_client == nullptr) continue;
+    if (not client->tcp_client->connected()) return true;  // to be deleted
+#ifndef TINY_MQTT_ASYNC
+    if (client->tcp_client->available() > 0 and not throttled(client)) return true;
+#endif
+  }
+#ifndef TINY_MQTT_ASYNC
+  if (remote_broker and remote_broker->tcp_client and remote_broker->tcp_client->available() > 0)
+    return true;
+#endif
+  return false;
+}
+
+uint32_t MqttBroker::msUntilNextTimer() const
+{
+  uint32_t next = UINT32_MAX;
+  uint32_t now = millis();
+  auto check = [&](const MqttClient* client)
+  {
+    if (client->keep_alive == 0 or client->alive == 0 or client->tcp_client == nullptr) return;
+    uint32_t ms = client->alive > now ? client->alive - now : 0;
+    if (ms < next) next = ms;
+  };
+  for(auto client: clients)
+  {
+    check(client);
+    uint32_t ms = throttled(client);
+    if (ms and ms < next) next = ms;
+  }
+  if (sys_period)
+  {
+    uint32_t ms = now - sys_last >= sys_period ? 0 : sys_period - (now - sys_last);
+    if (ms < next) next = ms;
+  }
+  if (remote_broker) check(remote_broker);
+  return next;
+}
+
+bool MqttBroker::waitForEvent(uint32_t timeout_ms)
+{
+  if (pendingWork()) return true;
+  uint32_t timer = msUntilNextTimer();
+  if (timer < timeout_ms) timeout_ms = timer;
+  if (timeout_ms == 0) return true;
+  if (timeout_ms > INT32_MAX) timeout_ms = INT32_MAX;  // negative for poll()
+
+#if defined(TINY_MQTT_EPOLL)
+  return server->poll(static_cast<int>(timeout_ms)) > 0 or pendingWork();
+#elif defined(TINY_MQTT_ASYNC) && defined(ESP32)
+  // Notifications sent while we were not waiting are kept by FreeRTOS.
+  // Not pdMS_TO_TICKS(), which overflows past 4.2e6 ms at 1 kHz
+  waiter = xTaskGetCurrentTaskHandle();
+  return ulTaskNotifyTake(pdTRUE, timeout_ms / portTICK_PERIOD_MS) > 0;
+#else
+  uint32_t start = millis();
+  while(millis() - start < timeout_ms)
+  {
+    delay(1);
+    if (pendingWork()) return true;
+  }
+  return false;
+#endif
+}
+
+void MqttBroker::runUntil(uint32_t deadline)
+{
+  // Signed: loop() may end past the deadline
+  while(static_cast<int32_t>(deadline - millis()) > 0)
+  {
+    loop();
+    int32_t remaining = static_cast<int32_t>(deadline - millis());
+    if (remaining <= 0) return;
+    waitForEvent(remaining);
+  }
 }
 
 MqttError MqttBroker::subscribe(const Topic& topic, uint8_t qos)
@@ -221,18 +595,106 @@ MqttError MqttBroker::subscribe(const Topic& topic, uint8_t qos)
   return MqttNowhereToSend;
 }
 
+// Payload of a publish message
+static const char* publishPayload(const MqttMessage& msg)
+{
+  const char* payload = msg.getVHeader();
+  uint16_t len;
+  MqttMessage::getString(payload, len);
+  payload += len;
+  if (msg.flags() & 0x06) payload += 2;  // packet identifier
+  return payload;
+}
+
+void MqttBroker::suppressUnchanged(const Topic& filter, uint32_t max_silence_ms)
+{
+  unchanged_filters.push_back(std::make_pair(filter, max_silence_ms));
+  last_publish.clear();  // topics are matched again against all filters
+}
+
+bool MqttBroker::unchanged(const Topic& topic, const MqttMessage& msg) const
+{
+  if (unchanged_filters.empty()) return false;
+  if (topic.getIndex() == 0) return false;  // StringIndexer full, the name is lost
+
+  // FNV-1a of the topic name: distinct topics may share an index once the
+  // StringIndexer is full
+  uint64_t key = 14695981039346656037ull;
+  for(const char* p = topic.c_str(); *p; p++)
+    key = (key ^ static_cast<uint8_t>(*p)) * 1099511628211ull;
+
+  uint32_t now = millis();
+  auto it = last_publish.find(key);
+  if (it == last_publish.end())
+  {
+    const std::pair<Topic, uint32_t>* match = nullptr;
+    for(const auto& filter: unchanged_filters)
+      if (filter.first.matches(topic)) { match = &filter; break; }
+    if (match == nullptr) return false;
+    if (last_publish.size() >= MqttConfig::SuppressedTopics)
+    {
+      // Forget the least recently published topic: its next copy is forwarded
+      auto oldest = last_publish.begin();
+      for(auto lp = last_publish.begin(); lp != last_publish.end(); lp++)
+        if (last_sequence - lp->second.published > last_sequence - oldest->second.published) oldest = lp;
+      last_publish.erase(oldest);
+    }
+    LastPublish last{};
+    last.max_silence = match->second;
+    it = last_publish.insert(std::make_pair(key, last)).first;
+  }
+  LastPublish& last = it->second;
+  last.published = ++last_sequence;
+
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for(const char* p = publishPayload(msg); p < msg.end(); p++)
+    hash = (hash ^ static_cast<uint8_t>(*p)) * 16777619u;
+
+  if (last.seen and last.hash == hash
+      and (last.max_silence == 0 or now - last.forwarded < last.max_silence))
+  {
+    suppressed++;
+    return true;
+  }
+  last.seen = true;
+  last.hash = hash;
+  last.forwarded = now;
+  return false;
+}
+
 MqttError MqttBroker::publish(const MqttClient* source, const Topic& topic, MqttMessage& msg) const
 {
   MqttError retval = MqttOk;
 
   debug("MqttBroker::publish");
+  if (MqttConfig::FlightRecords and flight_on_request
+      and topic.c_str()[0] == '$' and strcmp(topic.c_str(), "$SYS/broker/flight/dump") == 0)
+  {
+    publishFlightRecorder();
+    return MqttOk;
+  }
+  if (unchanged(topic, msg)) return MqttOk;
+  TM_PROFILE_SCOPE(MqttProfiler::Fanout);
+  TM_TRACE_SCOPE("fanout");
+  if (relay and source) relay(relay_context, topic, msg);
+#ifdef TINY_MQTT_EPOLL
+  if (shm_writer)
+  {
+    const char* payload = publishPayload(msg);
+    shm_writer->write(topic.c_str(), topic.str().length(), payload, msg.end()-payload);
+  }
+  if (fanout and clients.size() >= fanout_threshold and not (remote_broker && remote_broker->connected()))
+    return publishParallel(topic, msg);
+#endif
   int i=0;
+  size_t delivered = 0;
   for(auto client: clients)
   {
     i++;
 #if TINY_MQTT_DEBUG
     Console << __LINE__ << " broker:" << (remote_broker && remote_broker->connected() ? "linked" : "alone") <<
-       "  srce=" << (source->isLocal() ? "loc" : "rem") << " clt#" << i << ", local=" << client->isLocal() << ", con=" << client->connected() << endl;
+       "  srce=" << (source == nullptr ? "relay" : source->isLocal() ? "loc" : "rem") << " clt#" << i << ", local=" << client->isLocal() << ", con=" << client->connected() << endl;
 #endif
     bool doit = false;
     if (remote_broker && remote_broker->connected())  // this (MqttBroker) is connected (to a external broker)
@@ -255,12 +717,47 @@ MqttError MqttBroker::publish(const MqttClient* source, const Topic& topic, Mqtt
     Console << ", doit=" << doit << ' ';
 #endif
 
-    if (doit) retval = client->publishIfSubscribed(topic, msg);
+    if (doit) retval = client->publishIfSubscribed(topic, msg, &delivered);
     debug("");
   }
+  MqttMetrics::record(MqttMetrics::FanoutWidth, delivered);
   return retval;
 }
 
+#ifdef TINY_MQTT_EPOLL
+MqttError MqttBroker::publishParallel(const Topic& topic, MqttMessage& msg) const
+{
+  msg.complete();
+
+  // Matching is done here: topics are interned by this thread only
+  const char* payload = publishPayload(msg);
+  fanout_targets.clear();
+  for(auto client: clients)
+    if (client->tcp_client and client->isSubscribedTo(topic))
+    {
+      fanout_targets.push_back(client);
+      MqttFlightRecorder::record(MqttFlightRecorder::Sent, client->slot, *msg.begin(), topic.getIndex(), payload, msg.end()-payload);
+    }
+
+  size_t delivered = fanout_targets.size();
+  MqttMetrics::packetOut(MqttMessage::Type::Publish, delivered);
+  if (fanout_targets.size() >= fanout_threshold)
+    fanout->run(fanout_targets.data(), fanout_targets.size(), msg.begin(), msg.end()-msg.begin());
+  else
+    for(auto client: fanout_targets)
+      client->write(msg.begin(), msg.end()-msg.begin());
+
+  // Local clients run their callbacks in this thread, once the targets are
+  // no longer needed (a callback may publish again)
+  for(size_t i=0; i<clients.size(); i++)
+    if (clients[i]->tcp_client == nullptr)
+      clients[i]->publishIfSubscribed(topic, msg, &delivered);
+
+  MqttMetrics::record(MqttMetrics::FanoutWidth, delivered);
+  return MqttOk;
+}
+#endif
+
 bool MqttBroker::compareString(
     const char* good,
     const char* str,
@@ -282,7 +779,7 @@ void MqttClient::clientAlive(uint32_t more_seconds)
   debug("MqttClient::clientAlive");
   if (keep_alive)
   {
-#ifdef EPOXY_DUINO
+#if defined(EPOXY_DUINO) && !defined(TINY_MQTT_EPOLL)
     alive=millis()+500000+0*more_seconds;
 #else
     alive=millis()+1000*(keep_alive+more_seconds);
@@ -294,35 +791,173 @@ void MqttClient::clientAlive(uint32_t more_seconds)
 
 void MqttClient::loop()
 {
-  if (keep_alive && (millis() >= alive))
+  if (tcp_client)  // local clients are driven by their broker
   {
-    if (local_broker)
-    {
-      debug(red << "timeout client");
-      close();
-      debug(red << "closed");
-    }
-    else if (tcp_client && tcp_client->connected())
-    {
-      debug("pingreq");
-      uint16_t pingreq = MqttMessage::Type::PingReq;
-      tcp_client->write((const char*)(&pingreq), 2);
-      clientAlive(0);
+    if (keepAliveExpired()) onKeepAliveExpired();
+    receive();
+  }
+  if (batch.size()) flushBatch();
+}
 
-      // TODO when many MqttClient passes through a local broker
-      // there is no need to send one PingReq per instance.
-    }
+size_t MqttClient::subscriptionCost(const Topic& topic)
+{
+  // A node of std::set holds 3 pointers and a color besides the Topic
+  return 4 * sizeof(void*) + sizeof(Topic) + topic.str().length() + 1;
+}
+
+size_t MqttClient::memoryUsage() const
+{
+  size_t bytes = sizeof(MqttClient) + message.capacity() + clientId.capacity() + subscriptions_bytes;
+  bytes += batch.capacity() * sizeof(Delivery) + batch_offsets.capacity() * sizeof(uint32_t) + batch_payloads.capacity();
+#ifdef TINY_MQTT_ASYNC
+  bytes += out_queue.capacity();
+#endif
+  return bytes;
+}
+
+void MqttClient::shrink()
+{
+  message.shrink();
+  if (batch.empty())
+  {
+    decltype(batch)().swap(batch);
+    decltype(batch_offsets)().swap(batch_offsets);
+    decltype(batch_payloads)().swap(batch_payloads);
+  }
+#ifdef TINY_MQTT_ASYNC
+  if (out_queue.empty()) string().swap(out_queue);
+#endif
+}
+
+void MqttClient::flushBatch()
+{
+  // The callback may publish, and so append to the batch
+  decltype(batch) deliveries;
+  decltype(batch_offsets) offsets;
+  decltype(batch_payloads) payloads;
+  deliveries.swap(batch);
+  offsets.swap(batch_offsets);
+  payloads.swap(batch_payloads);
+
+  for(size_t i=0; i<deliveries.size(); i++)
+    deliveries[i].payload = payloads.c_str() + offsets[i];
+  MqttMetrics::record(MqttMetrics::BatchSize, deliveries.size());
+  if (batch_callback) batch_callback(this, deliveries.data(), deliveries.size());
+
+  // Keep the capacity for the next batch
+  if (batch.empty())
+  {
+    deliveries.clear();
+    offsets.clear();
+    payloads.clear();
+    batch.swap(deliveries);
+    batch_offsets.swap(offsets);
+    batch_payloads.swap(payloads);
+  }
+}
+
+void MqttClient::onKeepAliveExpired()
+{
+  if (local_broker)
+  {
+    debug(red << "timeout client");
+    close();
+    debug(red << "closed");
+  }
+  else if (tcp_client && tcp_client->connected())
+  {
+    debug("pingreq");
+    uint16_t pingreq = MqttMessage::Type::PingReq;
+    MqttMetrics::packetOut(MqttMessage::Type::PingReq);
+    MqttFlightRecorder::record(MqttFlightRecorder::Sent, slot, MqttMessage::Type::PingReq, 0, "", 0);
+    write((const char*)(&pingreq), 2);
+    clientAlive(0);
+
+    // TODO when many MqttClient passes through a local broker
+    // there is no need to send one PingReq per instance.
   }
+}
+
+void MqttClient::receive()
+{
+  TM_PROFILE_SCOPE(MqttProfiler::ClientRead);
 #ifndef TINY_MQTT_ASYNC
+  char buf[MqttConfig::ReadChunk];
   while(tcp_client && tcp_client->available()>0)
   {
-    message.incoming(tcp_client->read());
+    if (local_broker and local_broker->throttled(this)) break;
+    TM_TRACE_BEGIN(read, "read");
+    int len = tcp_client->read(reinterpret_cast<uint8_t*>(buf), sizeof(buf));
+    TM_TRACE_END(read);
+    if (len <= 0) break;
+    incoming(buf, len);
+  }
+#endif
+}
+
+void MqttClient::incoming(const char* data, size_t len)
+{
+  MqttMetrics::count(MqttMetrics::BytesIn, len);
+  bool budget = local_broker and local_broker->client_budget and tcp_client;
+  message.setMaxLength(budget ? local_broker->maxPacketLength(this) : MqttConfig::MaxBufferLength);
+  while(len)
+  {
+    TM_TRACE_BEGIN(parse, "parse");
+    size_t used = message.incoming(data, len);
+    TM_TRACE_END(parse);
+    data += used;
+    len -= used;
+    if (message.refused() and (budget or tcp_client))
+    {
+      // Over the budget, or its buffer could not grow
+      debug("Packet refused from " << clientId.c_str());
+      if (budget) local_broker->budget_stats.disconnected++;
+      message.reset();
+      close();
+      break;
+    }
     if (message.type())
     {
       processMessage(&message);
       message.reset();
+      // processMessage may have closed the connection
+      if (tcp_client and not tcp_client->connected()) break;
     }
   }
+}
+
+void MqttClient::write(const char* buf, size_t length)
+{
+  if (tcp_client == nullptr) return;
+  MqttMetrics::count(MqttMetrics::BytesOut, length);
+#ifdef TINY_MQTT_ASYNC
+  if (not tcp_client->connected()) return;
+  if (out_queue.size() + length > MqttConfig::MaxOutQueue)
+  {
+    // The peer does not read: close instead of queueing without limit,
+    // the broker deletes the client in loop()
+    debug(red << "Output queue full, closing " << clientId.c_str());
+    MqttMetrics::count(MqttMetrics::SlowClients);
+    clearOutQueue();
+    resetFlag(CltFlagConnected);
+    tcp_client->stop();
+    return;
+  }
+  if (out_queue.empty())
+  {
+    size_t sent = tcp_client->add(buf, length);
+    if (sent) tcp_client->send();
+    buf += sent;
+    length -= sent;
+  }
+  // Sent when the peer acknowledges previous data (see onAck)
+  if (length)
+  {
+    out_queue.append(buf, length);
+    MqttMetrics::gauge(MqttMetrics::OutQueueBytes, length);
+  }
+#else
+  tcp_client->write(buf, length);
 #endif
 }
 
@@ -347,21 +982,76 @@ void MqttClient::onConnect(void *mqttclient_ptr, TcpClient*)
 }
 
 #ifdef TINY_MQTT_ASYNC
-void MqttClient::onData(void* client_ptr, TcpClient*, void* data, size_t len)
+void MqttClient::attach(TcpClient* client)
+{
+  tcp_client = client;
+  tcp_client->onData(onData, this);
+  tcp_client->onDisconnect(onDisconnect, this);
+  tcp_client->onError(onError, this);
+  tcp_client->onAck(onAck, this);
+}
+
+void MqttClient::detach()
+{
+  // The AsyncClient may outlive us or call back while being deleted
+  if (tcp_client == nullptr) return;
+  tcp_client->onData(nullptr, nullptr);
+  tcp_client->onConnect(nullptr, nullptr);
+  tcp_client->onDisconnect(nullptr, nullptr);
+  tcp_client->onError(nullptr, nullptr);
+  tcp_client->onAck(nullptr, nullptr);
+  clearOutQueue();
+}
+
+void MqttClient::flush()
 {
-  char* char_ptr = static_cast<char*>(data);
-  MqttClient* client=static_cast<MqttClient*>(client_ptr);
-  while(len>0)
+  if (tcp_client == nullptr or out_queue.empty()) return;
+  size_t sent = tcp_client->add(out_queue.c_str(), out_queue.size());
+  if (sent)
   {
-    client->message.incoming(*char_ptr++);
-    if (client->message.type())
-    {
-      client->processMessage(&client->message);
-      client->message.reset();
-    }
-    len--;
+    tcp_client->send();
+    out_queue.erase(0, sent);
+    MqttMetrics::gauge(MqttMetrics::OutQueueBytes, -static_cast<int32_t>(sent));
   }
 }
+
+void MqttClient::onData(void* client_ptr, TcpClient*, void* data, size_t len)
+{
+  // Parsed in place, without copying data byte per byte
+  MqttClient* client = static_cast<MqttClient*>(client_ptr);
+  client->incoming(static_cast<const char*>(data), len);
+  if (client->local_broker) client->local_broker->notify();
+}
+
+void MqttClient::clearOutQueue()
+{
+  MqttMetrics::gauge(MqttMetrics::OutQueueBytes, -static_cast<int32_t>(out_queue.size()));
+  out_queue.clear();
+}
+
+void MqttClient::onDisconnect(void* client_ptr, TcpClient*)
+{
+  MqttClient* client = static_cast<MqttClient*>(client_ptr);
+  debug("MqttClient::onDisconnect " << client->id().c_str());
+  client->resetFlag(CltFlagConnected);
+  client->clearOutQueue();
+  // The broker deletes its disconnected clients in MqttBroker::loop()
+  if (client->local_broker) client->local_broker->notify();
+}
+
+void MqttClient::onError(void* client_ptr, TcpClient*, int8_t error)
+{
+  MqttClient* client = static_cast<MqttClient*>(client_ptr);
+  (void)error;
+  debug(red << "MqttClient::onError " << client->id().c_str() << ' ' << (int)error);
+  client->resetFlag(CltFlagConnected);
+  client->clearOutQueue();
+}
+
+void MqttClient::onAck(void* client_ptr, TcpClient*, size_t, uint32_t)
+{
+  static_cast<MqttClient*>(client_ptr)->flush();
+}
 #endif
 
 void MqttClient::resubscribe()
@@ -389,7 +1079,11 @@ MqttError MqttClient::subscribe(Topic topic, uint8_t qos)
   debug("MqttClient::subsribe(" << topic.c_str() << ")");
   MqttError ret = MqttOk;
 
-   subscriptions.insert(topic);
+  if (subscriptions.insert(topic).second)
+  {
+    subscriptions_bytes += subscriptionCost(topic);
+    if (local_broker) local_broker->subscribed(topic, true);
+  }
 
   if (local_broker==nullptr) // remote broker
   {
@@ -408,7 +1102,9 @@ MqttError MqttClient::unsubscribe(Topic topic)
   auto it=subscriptions.find(topic);
   if (it != subscriptions.end())
   {
+    subscriptions_bytes -= subscriptionCost(*it);
     subscriptions.erase(it);
+    if (local_broker) local_broker->subscribed(topic, false);
     if (local_broker==nullptr) // remote broker
     {
       return sendTopic(topic, MqttMessage::Type::UnSubscribe, 0);
@@ -435,6 +1131,9 @@ MqttError MqttClient::sendTopic(const Topic& topic, MqttMessage::Type type, uint
 
 void MqttClient::processMessage(MqttMessage* mesg)
 {
+  TM_PROFILE_SCOPE(MqttProfiler::ProcessMessage);
+  TM_TRACE_MESSAGE();
+  TM_TRACE_SCOPE("process_message");
 #if TINY_MQTT_DEBUG
   mesg->hexdump("Incoming");
 #endif
@@ -443,9 +1142,9 @@ void MqttClient::processMessage(MqttMessage* mesg)
   uint16_t len;
   bool bclose=true;
 
-#ifdef EPOXY_DUINO
-  counters[mesg->type()]++;
-#endif
+  MqttMetrics::packetIn(mesg->type());
+  if (mesg->type() != MqttMessage::Type::Publish)
+    MqttFlightRecorder::record(MqttFlightRecorder::Received, slot, *mesg->begin(), 0, header, mesg->end() - header);
 
   switch(mesg->type())
   {
@@ -532,8 +1231,10 @@ void MqttClient::processMessage(MqttMessage* mesg)
       if (tcp_client)
       {
         uint16_t pingreq = MqttMessage::Type::PingResp;
+        MqttMetrics::packetOut(MqttMessage::Type::PingResp);
+        MqttFlightRecorder::record(MqttFlightRecorder::Sent, slot, MqttMessage::Type::PingResp, 0, "", 0);
         debug(cyan << "Ping response to client ");
-        tcp_client->write((const char*)(&pingreq), 2);
+        write((const char*)(&pingreq), 2);
         bclose = false;
       }
       else
@@ -561,6 +1262,15 @@ void MqttClient::processMessage(MqttMessage* mesg)
           if (mesg->type() == MqttMessage::Type::Subscribe)
           {
             uint8_t qos = *payload++;
+            if (local_broker and subscriptions.count(topic) == 0
+                and (not local_broker->fits(this, subscriptionCost(topic))
+                     or not MqttMemory::fits(MqttMemory::Clients, subscriptionCost(topic))))
+            {
+              debug("Subscription over the budget");
+              local_broker->budget_stats.refused_subscriptions++;
+              qoss.push_back(0x80);
+              continue;
+            }
             if (qos != 0)
             {
               debug("Unsupported QOS" << qos << endl);
@@ -568,13 +1278,21 @@ void MqttClient::processMessage(MqttMessage* mesg)
             }
             else
               qoss.push_back(qos);
-            subscriptions.insert(topic);
+            if (subscriptions.insert(topic).second)
+            {
+              subscriptions_bytes += subscriptionCost(topic);
+              if (local_broker) local_broker->subscribed(topic, true);
+            }
           }
           else
           {
             auto it=subscriptions.find(topic);
             if (it != subscriptions.end())
+            {
+              subscriptions_bytes -= subscriptionCost(*it);
               subscriptions.erase(it);
+              if (local_broker) local_broker->subscribed(topic, false);
+            }
           }
         }
         debug("end loop");
@@ -599,10 +1317,19 @@ void MqttClient::processMessage(MqttMessage* mesg)
       #endif
       if (mqtt_connected() or tcp_client == nullptr)
       {
+        MqttMetrics::record(MqttMetrics::PublishBytes, mesg->end() - mesg->begin());
+        if (local_broker and tcp_client and not local_broker->admit(this, mesg->end() - mesg->begin()))
+        {
+          MqttFlightRecorder::record(MqttFlightRecorder::Dropped, slot, *mesg->begin(), 0, header, mesg->end() - header);
+          bclose = false;
+          break;
+        }
         uint8_t qos = mesg->flags();
         payload = header;
         mesg->getString(payload, len);
+        TM_TRACE_BEGIN(intern, "intern");
         Topic published(payload, len);
+        TM_TRACE_END(intern);
         payload += len;
         #if TINY_MQTT_DEBUG
           Console << "Received Publish (" << published.str().c_str() << ") size=" << (int)len << endl;
@@ -610,6 +1337,7 @@ void MqttClient::processMessage(MqttMessage* mesg)
         // << '(' << string(payload, len).c_str() << ')'  << " msglen=" << mesg->length() << endl;
         if (qos) payload+=2;  // ignore packet identifier if any
         len=mesg->end()-payload;
+        MqttFlightRecorder::record(MqttFlightRecorder::Received, slot, *mesg->begin(), published.getIndex(), payload, len);
         // TODO reset DUP
         // TODO reset RETAIN
 
@@ -622,7 +1350,14 @@ void MqttClient::processMessage(MqttMessage* mesg)
               Console << "has " << (callback ? "" : "no ") << " callback.\n";
             }
           #endif
-          if (callback and isSubscribedTo(published))
+          if (batch_callback and isSubscribedTo(published))
+          {
+            batch_offsets.push_back(batch_payloads.size());
+            batch_payloads.append(payload, len);
+            batch_payloads += '\0';
+            batch.push_back(Delivery{published, nullptr, len});
+          }
+          else if (callback and isSubscribedTo(published))
           {
             callback(this, published, payload, len);  // TODO send the real payload
           }
@@ -650,6 +1385,7 @@ void MqttClient::processMessage(MqttMessage* mesg)
   };
   if (bclose)
   {
+    MqttMetrics::count(MqttMetrics::ProtocolErrors);
     #if TINY_MQTT_DEBUG
       Console << red << "*************** Error msg 0x" << _HEX(mesg->type());
       mesg->hexdump("-------ERROR ------");
@@ -667,12 +1403,32 @@ void MqttClient::processMessage(MqttMessage* mesg)
 bool Topic::matches(const Topic& topic) const
 {
   if (getIndex() == topic.getIndex()) return true;
-  const char* p1 = c_str();
-  const char* p2 = topic.c_str();
+  const TopicString& filter = str();
+  const TopicString& name = topic.str();
+  const char* p1 = filter.c_str();
+  const char* p2 = name.c_str();
+  const char* const end2 = p2 + name.length();
 
   if (p1 == p2) return true;
   if (*p2 == '$' and *p1 != '$') return false;
 
+  // Compare the literal prefix of the filter at once
+  static const char wildcards[] = { '+', '#', '*' };
+  size_t literal = TextScan::findAnyOf(p1, filter.length(), wildcards, MqttConfig::WildcardStar ? 3 : 2);
+  if (literal <= name.length())
+  {
+    if (memcmp(p1, p2, literal)) return false;
+    p1 += literal;
+    p2 += literal;
+  }
+
+  // Moves p2 after the next '/' (or to its end)
+  auto skipLevel = [end2](const char*& p)
+  {
+    p += TextScan::find(p, end2 - p, '/');
+    if (p < end2) ++p;
+  };
+
   while(*p1 and *p2)
   {
     if (*p1 == '+')
@@ -680,14 +1436,14 @@ bool Topic::matches(const Topic& topic) const
       ++p1;
       if (*p1 and *p1!='/') return false;
       if (*p1) ++p1;
-      while(*p2 and *p2++!='/');
+      skipLevel(p2);
     }
     else if (*p1 == '#')
     {
       if (*++p1==0) return true;
       return false;
     }
-    else if (*p1 == '*')
+    else if (MqttConfig::WildcardStar and *p1 == '*')
     {
       const char c=*(p1+1);
       if (c==0) return true;
@@ -706,7 +1462,7 @@ bool Topic::matches(const Topic& topic) const
         }
         else
         {
-          while(*p2 and *p2++!='/');
+          skipLevel(p2);
           break;
         }
         ++p;
@@ -730,29 +1486,45 @@ bool Topic::matches(const Topic& topic) const
 // publish from local client
 MqttError MqttClient::publish(const Topic& topic, const char* payload, size_t pay_length)
 {
-  MqttMessage msg(MqttMessage::Publish);
+  // The message is reused, so that its buffer is allocated once,
+  // unless publish() is called again from a callback of this publish
+  static TINY_MQTT_THREAD_LOCAL MqttMessage reused;
+  static TINY_MQTT_THREAD_LOCAL bool reused_busy = false;
+  MqttMessage nested;
+  bool reuse = not reused_busy;
+  MqttMessage& msg = reuse ? reused : nested;
+  reused_busy = true;
+  TM_TRACE_MESSAGE();
+  TM_TRACE_SCOPE("publish");
+
+  msg.create(MqttMessage::Publish);
   msg.add(topic);
   msg.add(payload, pay_length, false);
   msg.complete();
 
+  MqttError retval;
   if (local_broker)
-  {
-    return local_broker->publish(this, topic, msg);
-  }
+    retval = local_broker->publish(this, topic, msg);
   else if (tcp_client)
-    return msg.sendTo(this);
+    retval = msg.sendTo(this);
   else
-    return MqttNowhereToSend;
+    retval = MqttNowhereToSend;
+  if (reuse) reused_busy = false;
+  return retval;
 }
 
 // republish a received publish if it matches any in subscriptions
-MqttError MqttClient::publishIfSubscribed(const Topic& topic, MqttMessage& msg)
+MqttError MqttClient::publishIfSubscribed(const Topic& topic, MqttMessage& msg, size_t* delivered)
 {
   MqttError retval=MqttOk;
 
   debug("mqttclient publishIfSubscribed " << topic.c_str() << ' ' << subscriptions.size());
-  if (isSubscribedTo(topic))
+  TM_TRACE_BEGIN(match, "match");
+  bool subscribed = isSubscribedTo(topic);
+  TM_TRACE_END(match);
+  if (subscribed)
   {
+    if (delivered) (*delivered)++;
     if (tcp_client)
       retval = msg.sendTo(this);
     else
@@ -800,16 +1572,22 @@ void MqttMessage::incoming(char in_byte)
       else
         size += static_cast<uint16_t>(in_byte & 0x7F)<<7;
 
-      if (size > MaxBufferLength)
+      if (size > max_length)
+      {
+        MqttMetrics::count(MqttMetrics::ParseErrors);
         state = Error;
+      }
       else if ((in_byte & 0x80) == 0)
       {
         vheader = buffer.length();
         if (size==0)
           state = Complete;
+        else if (buffer.capacity() < buffer.length() + size
+                 and not MqttMemory::fits(MqttMemory::Messages, buffer.length() + size + 1))
+          state = Error;  // no memory to receive it
         else
         {
-          buffer.reserve(size);
+          buffer.reserve(buffer.length() + size);
           state = VariableHeader;
         }
       }
@@ -838,10 +1616,40 @@ void MqttMessage::incoming(char in_byte)
   if (buffer.length() > MaxBufferLength)
   {
     debug("Too long " << state);
+    MqttMetrics::count(MqttMetrics::ParseErrors);
     reset();
   }
 }
 
+size_t MqttMessage::incoming(const char* data, size_t len)
+{
+  size_t used = 0;
+  // A complete message of unknown type is reset by the next byte, as in incoming(char),
+  // a refused one is left for the caller to see
+  while(used < len and ((state != Complete and state != Error) or used == 0))
+  {
+    if ((state == VariableHeader or state == PayLoad) and size)
+    {
+      // Bulk copy of the remaining bytes of the message
+      size_t chunk = len - used;
+      if (chunk > size) chunk = size;
+      buffer.append(data+used, chunk);
+      used += chunk;
+      size -= chunk;
+      if (size == 0) state = Complete;
+      if (buffer.length() > MaxBufferLength)
+      {
+        debug("Too long " << state);
+        MqttMetrics::count(MqttMetrics::ParseErrors);
+        reset();
+      }
+    }
+    else
+      incoming(data[used++]);
+  }
+  return used;
+}
+
 void MqttMessage::add(const char* p, size_t len, bool addLength)
 {
   if (addLength)
@@ -884,6 +1692,10 @@ MqttError MqttMessage::sendTo(MqttClient* client)
     debug(cyan << "sending " << buffer.size() << " bytes to " << client->id());
     encodeLength();
     hexdump("Sending ");
+    MqttMetrics::packetOut(buffer[0]);
+    size_t data = (buffer[1] & 0x80) ? 3 : 2;  // after the fixed header
+    MqttFlightRecorder::record(MqttFlightRecorder::Sent, client->slot, buffer[0], 0, &buffer[data], buffer.size() - data);
+    TM_TRACE_SCOPE("write");
     client->write(&buffer[0], buffer.size());
   }
   else
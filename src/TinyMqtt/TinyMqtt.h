@@ -7,8 +7,14 @@
 
 // TODO Should add a AUnit with both TINY_MQTT_ASYNC and not TINY_MQTT_ASYNC
 // #define TINY_MQTT_ASYNC  // Uncomment this to use ESPAsyncTCP instead of normal cnx
-
-#if defined(ESP8266) || defined(EPOXY_DUINO)
+// #define TINY_MQTT_EPOLL  // Uncomment this to use native Linux sockets (host builds only)
+
+#if defined(TINY_MQTT_EPOLL)
+  #include <Arduino.h>
+  #include "TcpEpoll.h"
+  #include "ShmRing.h"
+  #include "FanoutExecutor.h"
+#elif defined(ESP8266) || defined(EPOXY_DUINO)
   #ifdef TINY_MQTT_ASYNC
     #include <ESPAsyncTCP.h>
   #else
@@ -35,8 +41,17 @@
 
 #include <vector>
 #include <set>
+#include <map>
 #include <string>
+#include "TinyMqttConfig.h"
 #include "StringIndexer.h"
+#include "TextScan.h"
+#include "RateLimit.h"
+#include "MqttMetrics.h"
+#include "MqttProfiler.h"
+#include "FlightRecorder.h"
+#include "MqttAllocations.h"
+#include "MqttTrace.h"
 using namespace std;
 
 #define TINY_MQTT_DEFAULT_CLIENT_ID "Tiny"
@@ -57,6 +72,9 @@ using namespace std;
 #ifdef TINY_MQTT_ASYNC
   using TcpClient = AsyncClient;
   using TcpServer = AsyncServer;
+#elif defined(TINY_MQTT_EPOLL)
+  using TcpClient = EpollClient;
+  using TcpServer = EpollServer;
 #else
   using TcpClient = WiFiClient;
   using TcpServer = WiFiServer;
@@ -87,7 +105,7 @@ class Topic : public IndexedString
 class MqttClient;
 class MqttMessage
 {
-  const uint16_t MaxBufferLength = 4096;  //hard limit: 16k due to size decoding
+  static constexpr uint16_t MaxBufferLength = MqttConfig::MaxBufferLength;
   public:
     enum __attribute__((packed)) Type
     {
@@ -124,10 +142,13 @@ class MqttMessage
     MqttMessage() { reset(); }
     MqttMessage(Type t, uint8_t bits_d3_d0=0) { create(t); buffer[0] |= bits_d3_d0; }
     void incoming(char byte);
+    // Consumes bytes until the message is complete, returns the count consumed
+    size_t incoming(const char* data, size_t len);
     void add(char byte) { incoming(byte); }
     void add(const char* p, size_t len, bool addLength=true );
     void add(const string& s) { add(s.c_str(), s.length()); }
-    void add(const Topic& t) { add(t.str()); }
+    void add(const Topic& t) { add(t.c_str(), t.str().length()); }
+    const char* begin() const { return &buffer[0]; }
     const char* end() const { return &buffer[0]+buffer.size(); }
     const char* getVHeader() const { return &buffer[vheader]; }
     void complete() { encodeLength(); }
@@ -157,15 +178,31 @@ class MqttMessage
     MqttError sendTo(MqttClient*);
     void hexdump(const char* prefix=nullptr) const;
 
+    // Longer incoming messages are refused (see MqttBroker::setClientBudget)
+    void setMaxLength(uint16_t length) { max_length = length; }
+    bool refused() const { return state == Error; }
+    size_t capacity() const { return buffer.capacity(); }
+    // Releases the buffer of an idle message
+    void shrink() { if (buffer.empty()) decltype(buffer)().swap(buffer); }
+
   private:
     void encodeLength();
 
-    string buffer;
+    MqttString<MqttMemory::Messages> buffer;
     uint8_t vheader;
     uint16_t size;  // bytes left to receive
+    uint16_t max_length = MaxBufferLength;
     State state;
 };
 
+/** See MqttBroker::setClientBudget() and setMemoryPressure() */
+struct MqttBudgetStats
+{
+  uint32_t refused_subscriptions = 0;
+  uint32_t disconnected = 0;   // packet over the budget
+  uint32_t sheds = 0;          // calls to shedMemory()
+};
+
 class MqttBroker;
 class MqttClient
 {
@@ -187,9 +224,22 @@ class MqttClient
     CltFlagToDelete = 2
   };
   public:
+    TINY_MQTT_ALLOCATED_IN(MqttMemory::Clients)
 
     using CallBack = void (*)(const MqttClient* source, const Topic& topic, const char* payload, size_t payload_length);
 
+    /** A received publish, payload is null terminated */
+    struct Delivery
+    {
+      Topic topic;
+      const char* payload;
+      size_t length;
+#ifdef TINY_MQTT_TRACE
+      uint32_t trace_message = MqttTrace::message();
+#endif
+    };
+    using BatchCallBack = void (*)(const MqttClient* source, const Delivery* deliveries, size_t count);
+
     /** Constructor. Broker is the adress of a local broker if not null
         If you want to connect elsewhere, leave broker null and use connect() **/
     MqttClient(MqttBroker* broker = nullptr, const string& id = TINY_MQTT_DEFAULT_CLIENT_ID);
@@ -208,10 +258,7 @@ class MqttClient
            or (tcp_client and tcp_client->connected());
     }
 
-    void write(const char* buf, size_t length)
-    {
-      if (tcp_client) tcp_client->write(buf, length);
-    }
+    void write(const char* buf, size_t length);
 
     const string& id() const { return clientId; }
     void id(const string& new_id) { clientId = new_id; }
@@ -228,6 +275,11 @@ class MqttClient
       #endif
     };
 
+    /** Replaces the callback: publishes received are collected, then given
+        at once, in order of arrival, at the end of MqttBroker::loop() (local
+        client) or MqttClient::loop() (remote connection). */
+    void setBatchCallback(BatchCallBack fun) { batch_callback = fun; }
+
     // Publish from client to the world
     MqttError publish(const Topic&, const char* payload, size_t pay_length);
     MqttError publish(const Topic& t, const char* payload) { return publish(t, payload, strlen(payload)); }
@@ -274,11 +326,13 @@ class MqttClient
       #endif
     }
 
-#ifdef EPOXY_DUINO
-    static std::map<MqttMessage::Type, int> counters;  // Number of processed messages
-#endif
     uint32_t keepAlive() const { return keep_alive; }
 
+    /** Bytes owned by this client: receive buffer, subscriptions (and the
+        topic strings they reference), output queue and batch buffers.
+        Container nodes are estimated. See MqttBroker::setClientBudget() */
+    size_t memoryUsage() const;
+
   private:
     bool mqtt_connected() const { return cltFlags & CltFlagConnected; }
     void setFlag(CltFlags f) { cltFlags |= f; }
@@ -288,18 +342,36 @@ class MqttClient
     static void onConnect(void * client_ptr, TcpClient*);
 #ifdef TINY_MQTT_ASYNC
     static void onData(void* client_ptr, TcpClient*, void* data, size_t len);
+    static void onDisconnect(void* client_ptr, TcpClient*);
+    static void onError(void* client_ptr, TcpClient*, int8_t error);
+    static void onAck(void* client_ptr, TcpClient*, size_t len, uint32_t time);
+    void attach(TcpClient*);
+    void detach();
+    void flush();
+    void clearOutQueue();
 #endif
+    // Parse received bytes, processing each complete message
+    void incoming(const char* data, size_t len);
     MqttError sendTopic(const Topic& topic, MqttMessage::Type type, uint8_t qos);
     void resubscribe();
 
     friend class MqttBroker;
+    friend class MqttMessage;  // sendTo() records the slot
     MqttClient(MqttBroker* local_broker, TcpClient* client);
     // republish a received publish if topic matches any in subscriptions
-    MqttError publishIfSubscribed(const Topic& topic, MqttMessage& msg);
+    MqttError publishIfSubscribed(const Topic& topic, MqttMessage& msg, size_t* delivered = nullptr);
 
     void clientAlive(uint32_t more_seconds);
+    bool keepAliveExpired() const { return keep_alive && (millis() >= alive); }
+    void onKeepAliveExpired();
     void processMessage(MqttMessage* message);
+    void resetRate(const MqttRateLimit&);
+    void flushBatch();
+    void shrink();   // see MqttBroker::shedMemory()
+    static size_t subscriptionCost(const Topic&);
+    void receive();   // reads and processes what tcp_client received
 
+    uint8_t slot = 0;  // given by the broker, see MqttFlightRecorder
     uint8_t cltFlags = CltFlagNone;
     char mqtt_flags;
     uint32_t keep_alive = 30;
@@ -311,9 +383,19 @@ class MqttClient
     MqttBroker* local_broker=nullptr;
 
     TcpClient* tcp_client=nullptr;    // connection to remote broker
-    std::set<Topic>  subscriptions;
+    TokenBucket rate_messages;   // see MqttBroker::setRateLimit()
+    TokenBucket rate_bytes;
+#ifdef TINY_MQTT_ASYNC
+    string out_queue;   // bytes not accepted yet by the tcp stack
+#endif
+    std::set<Topic, std::less<Topic>, MqttAllocator<Topic, MqttMemory::Clients>>  subscriptions;
+    size_t subscriptions_bytes = 0;   // see subscriptionCost()
     string clientId;
     CallBack callback = nullptr;
+    BatchCallBack batch_callback = nullptr;
+    std::vector<Delivery, MqttAllocator<Delivery, MqttMemory::Clients>> batch;   // payloads are null, see flushBatch()
+    std::vector<uint32_t, MqttAllocator<uint32_t, MqttMemory::Clients>> batch_offsets;
+    MqttString<MqttMemory::Clients> batch_payloads;
 };
 
 class MqttBroker
@@ -325,13 +407,92 @@ class MqttBroker
     Connected,     // this->broker is connected and circular cnx avoided
   };
   public:
-    // TODO limit max number of clients
+    TINY_MQTT_ALLOCATED_IN(MqttMemory::Broker)
+    using Clients = std::vector<MqttClient*, MqttAllocator<MqttClient*, MqttMemory::Broker>>;
+
+    // See MqttConfig::MaxClients to limit the number of clients
     MqttBroker(uint16_t port);
     ~MqttBroker();
 
     void begin() { server->begin(); }
     void loop();
 
+    /** Blocks until a client connects or sends data, a client timer expires,
+        or timeout_ms elapses. Returns true if loop() has something to do.
+        Sockets are waited with epoll on host, AsyncTCP wakes the task with a
+        notification, otherwise the task sleeps by 1ms steps (allowing the
+        idle task to enter light sleep when power management is enabled). */
+    bool waitForEvent(uint32_t timeout_ms);
+
+    /** Runs loop() and waitForEvent() until millis() reaches deadline */
+    void runUntil(uint32_t deadline);
+
+#ifdef TINY_MQTT_EPOLL
+    /** Also accept local clients on a Unix domain socket */
+    bool listen(const char* unix_path) { return server->listenUnix(unix_path); }
+
+    /** Client end of a new in-memory connection to this broker, to be used
+        by the thread of the broker (see EpollServer::connectMemory) */
+    TcpClient connectMemory() { return server->connectMemory(); }
+
+    /** Writes every publish in the shared memory ring /name (see ShmRing.h),
+        readable by the processes that have the read permission of mode */
+    bool shareMemory(const char* name, size_t capacity = 1 << 20, mode_t mode = 0600);
+
+    /** Publishes reaching at least min_subscribers remote clients are
+        written in parallel by executor (see FanoutExecutor.h) */
+    void setFanoutExecutor(MqttFanoutExecutor* executor, size_t min_subscribers = 256)
+    { fanout = executor; fanout_threshold = min_subscribers; }
+#endif
+
+    /** Limits the publishes of each tcp client (local clients are not
+        limited). Publishes are checked before their topic is indexed. */
+    void setRateLimit(const MqttRateLimit& limit);
+    const MqttRateLimit& rateLimit() const { return rate_limit; }
+    const MqttRateStats& rateStats() const { return rate_stats; }
+
+    /** Bytes each tcp client may own (see MqttClient::memoryUsage()), 0 for
+        no limit. Subscriptions over the budget are refused (0x80 in the
+        SUBACK), a client sending a packet that does not fit is disconnected. */
+    void setClientBudget(size_t bytes) { client_budget = bytes; }
+    size_t clientBudget() const { return client_budget; }
+
+    /** When the free heap falls below free_heap bytes (checked every second,
+        ESP only), loop() calls shedMemory(). 0 disables. */
+    void setMemoryPressure(size_t free_heap) { pressure_threshold = free_heap; }
+
+    /** Releases optional memory: unused capacity of the clients buffers,
+        the state of suppressUnchanged() (the next copies are forwarded) and
+        the topic strings no longer used. */
+    void shedMemory();
+    const MqttBudgetStats& budgetStats() const { return budget_stats; }
+
+    /** Publishes on topics matching filter are forwarded only when their
+        payload differs from the previous one on the same topic, or when
+        max_silence_ms (if not 0) elapsed since the last forwarded copy. */
+    void suppressUnchanged(const Topic& filter, uint32_t max_silence_ms = 0);
+    uint32_t suppressedCount() const { return suppressed; }
+
+    /** Publishes statistics under $SYS/broker/ every period_ms (0 stops):
+        uptime, clients/connected, load/{messages,bytes}/{received,sent}
+        (per second over the period), messages/{received,sent,dropped,
+        suppressed}, heap/free (devices) and loop/p99_us. Rates and loop
+        duration come from MqttMetrics, so they cover the whole process. */
+    void publishSysStats(uint32_t period_ms);
+
+    /** Publishes the MqttProfiler stats of this thread as JSON, one topic
+        $SYS/broker/profile/<phase> per phase called at least once */
+    void publishProfile();
+
+    /** Publishes the records of MqttFlightRecorder, oldest first, as one
+        binary payload on $SYS/broker/flight */
+    void publishFlightRecorder() const;
+
+    /** When enabled, any client publishing on $SYS/broker/flight/dump calls
+        publishFlightRecorder(). Off by default: the records show the
+        traffic of every client to whoever subscribes to $SYS/broker/flight. */
+    void dumpFlightOnRequest(bool enable) { flight_on_request = enable; }
+
     /** Connect the broker to a parent broker */
     void connect(const string& host, uint16_t port=1883);
     /** returns true if connected to another broker */
@@ -345,12 +506,25 @@ class MqttBroker
         client->dump(indent);
     }
 
-    const std::vector<MqttClient*>  getClients() const { return clients; }
+    const Clients& getClients() const { return clients; }
+
+    /** Called for each message published through this broker by one of its
+        clients, in order to relay it elsewhere (see MqttReactor.h) */
+    using Relay = void (*)(void* context, const Topic& topic, const MqttMessage& msg);
+    /** Called with the same context each time a filter is added to or
+        removed from the subscriptions of a client, before the client is
+        acknowledged, so that the relay knows what this broker wants */
+    using Subscribed = void (*)(void* context, const Topic& filter, bool added);
+    void setRelay(Relay fun, void* context, Subscribed subscribed = nullptr)
+    { relay = fun; relay_context = context; relay_subscribed = subscribed; }
 
   private:
     friend class MqttClient;
+    friend class MqttReactor;
 
     static void onClient(void*, TcpClient*);
+    // Clients connected through the server, local clients excluded
+    size_t connectionsCount() const;
     bool checkUser(const char* user, uint8_t len) const
     { return compareString(auth_user, user, len); }
 
@@ -359,15 +533,43 @@ class MqttBroker
 
 
     MqttError publish(const MqttClient* source, const Topic& topic, MqttMessage& msg) const;
+    bool unchanged(const Topic& topic, const MqttMessage& msg) const;
+    void publishSys();
+    void publishSys(const char* name, uint32_t value) const;
+    void publishSys(const char* name, const char* payload, size_t len) const;
+#ifdef TINY_MQTT_EPOLL
+    MqttError publishParallel(const Topic& topic, MqttMessage& msg) const;
+#endif
 
     MqttError subscribe(const Topic& topic, uint8_t qos);
+    void subscribed(const Topic& filter, bool added) const
+    { if (relay_subscribed) relay_subscribed(relay_context, filter, added); }
+    void unsubscribeAll(const MqttClient* client) const;   // see setRelay()
 
     // For clients that are added not by the broker itself (local clients)
     void addClient(MqttClient* client);
     void removeClient(MqttClient* client);
+    void removeAllClients();
 
     bool compareString(const char* good, const char* str, uint8_t str_len) const;
-    std::vector<MqttClient*>  clients;
+    // Returns false if the publish of client must be ignored
+    bool admit(MqttClient* client, size_t bytes);
+    // Time left before client can be read again (MqttRateLimit::Delay)
+    uint32_t throttled(const MqttClient* client) const;
+    // False if client would exceed its budget by owning more bytes
+    bool fits(const MqttClient* client, size_t more) const;
+    // Longest packet client can receive within its budget
+    uint16_t maxPacketLength(const MqttClient* client) const;
+    bool pendingWork();
+    uint32_t msUntilNextTimer() const;
+    void notify()
+    {
+#if defined(TINY_MQTT_ASYNC) && defined(ESP32)
+      if (waiter) xTaskNotifyGive(waiter);
+#endif
+    }
+
+    Clients clients;
 
   private:
     TcpServer* server = nullptr;
@@ -375,6 +577,50 @@ class MqttBroker
     const char* auth_user = "guest";
     const char* auth_password = "guest";
     MqttClient* remote_broker = nullptr;
+    Relay relay = nullptr;
+    void* relay_context = nullptr;
+    Subscribed relay_subscribed = nullptr;
+    MqttRateLimit rate_limit;
+    MqttRateStats rate_stats;
+
+    // See setClientBudget() and setMemoryPressure()
+    size_t client_budget = 0;
+    size_t pressure_threshold = 0;
+    uint32_t pressure_last = 0;
+    MqttBudgetStats budget_stats;
+
+    // See suppressUnchanged()
+    struct LastPublish
+    {
+      uint32_t max_silence;
+      uint32_t hash;       // of the payload
+      uint32_t forwarded;  // millis() of the last forwarded copy
+      uint32_t published;  // last_sequence of the last copy, for the eviction
+      bool seen;
+    };
+    std::vector<std::pair<Topic, uint32_t>, MqttAllocator<std::pair<Topic, uint32_t>, MqttMemory::Broker>> unchanged_filters;
+    // Topics matching a filter, keyed by the hash of their name: interned
+    // topics would fill the StringIndexer. At most MqttConfig::SuppressedTopics.
+    mutable std::map<uint64_t, LastPublish, std::less<uint64_t>,
+      MqttAllocator<std::pair<const uint64_t, LastPublish>, MqttMemory::Broker>> last_publish;
+    mutable uint32_t suppressed = 0;
+    mutable uint32_t last_sequence = 0;  // publishes seen by unchanged()
+
+    // See publishSysStats()
+    uint32_t created;   // millis()
+    uint32_t sys_period = 0;
+    uint32_t sys_last = 0;
+    MqttMetrics::Snapshot* sys_snapshot = nullptr;  // at the last publication
+    bool flight_on_request = false;  // see dumpFlightOnRequest()
+#if defined(TINY_MQTT_ASYNC) && defined(ESP32)
+    TaskHandle_t waiter = nullptr;  // task blocked in waitForEvent()
+#endif
+#ifdef TINY_MQTT_EPOLL
+    MqttShmWriter* shm_writer = nullptr;
+    MqttFanoutExecutor* fanout = nullptr;
+    size_t fanout_threshold = 0;
+    mutable Clients fanout_targets;
+#endif
 
     State state = Disconnected;
 };
@@ -0,0 +1,72 @@
+// vim: ts=2 sw=2 expandtab
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/***
+ * Compile time configuration of TinyMqtt.
+ *
+ * Every limit and optional feature is a constant of the policy below, so the
+ * compiler drops the code of disabled features and sizes are known at compile
+ * time. To change them, write a struct deriving from TinyMqttDefaultConfig
+ * that overrides some members, in a header passed with build flags:
+ *
+ *   -DTINY_MQTT_CONFIG_HEADER='"my_config.h"' -DTINY_MQTT_CONFIG=MyConfig
+ *
+ *   struct MyConfig : TinyMqttDefaultConfig
+ *   {
+ *     static constexpr size_t MaxClients = 8;
+ *     static constexpr bool WildcardStar = false;
+ *   };
+ *
+ * The transport (TINY_MQTT_ASYNC, TINY_MQTT_EPOLL) and TINY_MQTT_DEBUG stay
+ * macros because they select which headers are included.
+ */
+struct TinyMqttDefaultConfig
+{
+  // Largest MQTT packet accepted (hard limit: 16k due to size decoding)
+  static constexpr uint16_t MaxBufferLength = 4096;
+
+  // Connections accepted by a broker, 0 for no limit. Local clients (see
+  // MqttClient(MqttBroker*)) do not count. When set, the list of clients is
+  // allocated once for that many clients.
+  static constexpr size_t MaxClients = 0;
+
+  // A new connection is closed if it does not send CONNECT within this delay
+  static constexpr uint32_t ConnectTimeoutMs = 5000;
+
+  // Bytes queued for a client that AsyncTCP did not accept yet (TINY_MQTT_ASYNC).
+  // Past that, the client does not read and is disconnected
+  static constexpr size_t MaxOutQueue = 16384;
+
+  // Size of the stack buffer used to read sockets
+  static constexpr size_t ReadChunk = 256;
+
+  // Topic::matches() accepts the non standard '*' wildcard (any number of levels
+  // inside a filter, like "home/*/temperature")
+  static constexpr bool WildcardStar = true;
+
+  // Update the counters of MqttMetrics (about 700 bytes of RAM)
+  static constexpr bool Metrics = true;
+
+  // Packets kept by MqttFlightRecorder (32 bytes each), 0 to disable it
+  static constexpr size_t FlightRecords = 64;
+
+  // Topics remembered by MqttBroker::suppressUnchanged() (about 40 bytes
+  // each), the least recently published ones are forgotten first
+  static constexpr size_t SuppressedTopics = 128;
+};
+
+#ifdef TINY_MQTT_CONFIG_HEADER
+  #include TINY_MQTT_CONFIG_HEADER
+#endif
+
+#ifndef TINY_MQTT_CONFIG
+  #define TINY_MQTT_CONFIG TinyMqttDefaultConfig
+#endif
+
+using MqttConfig = TINY_MQTT_CONFIG;
+
+static_assert(MqttConfig::MaxBufferLength <= 16383, "MaxBufferLength: size decoding is limited to 2 bytes");
+static_assert(MqttConfig::ReadChunk > 0, "ReadChunk must not be null");
+static_assert(MqttConfig::SuppressedTopics > 0, "SuppressedTopics must not be null");